@@ -15,6 +15,6 @@ SOURCES="capra.c xdg-shell-protocol.c"
 # DEPS="$DEPS -DENABLE_MPD_STATUS=1 -lmpdclient"
 
 set -x
-$CC $CFLAGS $XWAYLAND_CFLAGS $SOURCES $DEPS -I. -Wall -DWLR_USE_UNSTABLE -lm -linput $XWAYLAND_LIBS -o capra
+$CC $CFLAGS $XWAYLAND_CFLAGS $SOURCES $DEPS -I. -Wall -DWLR_USE_UNSTABLE -lm -lpthread -linput $XWAYLAND_LIBS -o capra
 
 
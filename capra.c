@@ -13,8 +13,10 @@
    See the License for the specific language governing permissions and
    limitations under the License.
 */
+#define _GNU_SOURCE // pipe2, posix_spawn_file_actions_addclosefrom_np
 #include <libinput.h>
 #include <linux/input-event-codes.h>
+#include <wlr/backend/headless.h>
 #include <wlr/backend/libinput.h>
 #include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_compositor.h>
@@ -34,7 +36,7 @@
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_input_method_v2.h>
 #include <wlr/types/wlr_keyboard.h>
-//#include <wlr/types/wlr_keyboard_group.h>
+#include <wlr/types/wlr_keyboard_group.h>
 #include <wlr/types/wlr_layer_shell_v1.h>
 //#include <wlr/types/wlr_linux_dmabuf_v1.h>
 #include <wlr/types/wlr_matrix.h>
@@ -71,6 +73,7 @@
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/render/vulkan.h>
 #include <wlr/util/log.h>
+#include <wlr/util/region.h>
 #include <xkbcommon/xkbcommon.h>
 
 #if USE_XWAYLAND
@@ -79,9 +82,14 @@
 #endif
 
 #include <assert.h>
-#include <pthread.h>
+#include <dirent.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -89,6 +97,8 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#include "pool.c"
+
 static FILE *log_file;
 
 static inline void debug_printf(const char *format, ...) {
@@ -155,34 +165,63 @@ enum Cursor_Mode {
 #define layer_is_output_layer(layer) (((layer) >= LAYER_OUTPUT_STICKY) && ((layer) <= LAYER_OUTPUT_BOTTOM))
 #define client_is_fullscreen(client) ((client)->config.flags & CLIENT_CONFIG_FULLSCREEN)
 #define can_interact_with_client(client) (((client)->type != CLIENT_TYPE_LAYER) && !client_is_fullscreen(client))
-#define OUTPUT_CURRENT_VIEW(output) (&((output)->views[(output)->current_view]))
+#define OUTPUT_CURRENT_VIEW(output) ((output)->views[(output)->current_view]) // Always allocated
 
 /* ================================================================================
  * Structs
  * ================================================================================*/
 typedef struct Client Client;
+typedef struct Client_Process Client_Process;
 typedef struct Keyboard Keyboard;
 typedef struct Layout Layout;
 typedef struct Output Output;
 typedef struct View View;
 typedef struct Pointer_Constraint Pointer_Contraint;
+typedef struct Client_Table Client_Table;
 
 enum {
 	CLIENT_CONFIG_FULLSCREEN = 0x1,
 	CLIENT_CONFIG_MINIMIZED = 0x2,
 };
 
+enum Client_Priority {
+	CLIENT_PRIORITY_NORMAL,
+	CLIENT_PRIORITY_FOCUSED,
+	CLIENT_PRIORITY_HIDDEN,
+};
+
+// Every wlr_surface gets one, since any commit can change what's on screen
+typedef struct Surface_Watch {
+	struct wl_listener on_commit;
+	struct wl_listener on_destroy;
+} Surface_Watch;
+
+// A process with mapped toplevels, for CONFIG.client_priorities. Its clients share it
+typedef struct Client_Process {
+	pid_t pid;
+	int base_nice; // Before we changed it
+	int nice; // What we last set
+	int min_nice; // Lowest nice we're allowed to give it
+	enum Client_Priority priority;
+	uint32_t client_count;
+	uint32_t visible_clients;
+} Client_Process;
+
 typedef struct Client {
 	struct wl_list link;
-	struct wl_list update_link;
 	enum Client_Type type;
 	uint16_t layer;
 	uint16_t old_layer;
 	Output *output;
 	View *view;
+	Client_Table *table;
+	uint32_t table_index;
+	Client_Process *process; // NULL unless client priorities are on
 	struct {
 		uint32_t requesting_fullscreen : 1;
 		uint32_t mapped : 1;
+		uint32_t visible : 1; // Last visibility sent to the client
+		uint32_t awaiting_output : 1; // Mapped while there were no outputs, see handle_new_output
 	};
 	struct {
 		int32_t x, y;
@@ -190,11 +229,13 @@ typedef struct Client {
 		uint32_t flags;
 	} config;
 	
+	struct wl_listener on_commit;
 	struct wl_listener on_destroy;
 	struct wl_listener on_map;
 	struct wl_listener on_request_configure;
 	struct wl_listener on_request_fullscreen;
 	struct wl_listener on_request_minimize;
+	struct wl_listener on_set_title;
 	struct wl_listener on_unmap;
 	union {
 #if USE_XWAYLAND
@@ -205,28 +246,96 @@ typedef struct Client {
 	};
 } Client;
 
+/*
+ * Packed copy of the geometry of every client in one layer list, so that hit
+ * testing and culling can run over flat arrays instead of chasing wl_list links
+ * into Client and wlr_surface. Entries are in stacking order, bottom first
+ * (the reverse of the wl_list). The layer an entry belongs to is the table
+ * itself, see View.tables.
+ *
+ * Kept in sync by attach_client()/detach_client(), configure_client() and
+ * surface commits.
+ */
+typedef struct Client_Table {
+	int32_t *x, *y;
+	int32_t *width, *height; // Size of the committed surface
+	uint32_t *flags; // Client config flags
+	Client **clients;
+	uint32_t count;
+	uint32_t capacity;
+} Client_Table;
+
+// Tables are scanned a block at a time so that the scans vectorize. Capacity is
+// a whole number of blocks, and the slots past count are kept empty.
+#define CLIENT_TABLE_BLOCK 16
+
+/*
+ * Input latency, per output. Every stage is measured from the time the kernel
+ * stamped on the input event, which only has millisecond resolution.
+ * Dumped with `pkill -USR1 capra`.
+ */
+enum {
+	LATENCY_DISPATCH, // Our input handler starts
+	LATENCY_HANDLED, // Our input handler is done, including binds and focus changes
+	LATENCY_CLIENT_COMMIT, // The focused client's next surface commit
+	LATENCY_OUTPUT_COMMIT, // Our first output commit after that
+	NUM_LATENCY_STAGES,
+};
+
+// 4 buckets per power of two microseconds, so each is at most 25% wide
+#define LATENCY_BUCKET_COUNT 96
+// Inputs the focused client doesn't react to within this are dropped
+#define LATENCY_SAMPLE_TIMEOUT_US 1000000
+
+typedef struct {
+	uint32_t buckets[LATENCY_BUCKET_COUNT];
+	uint64_t count;
+	uint64_t max_us;
+} Latency_Histogram;
+
+// Either server.keyboard_group's keyboard, or a device that couldn't join it
 typedef struct Keyboard {
 	struct wlr_keyboard *wlr;
 	struct wl_listener on_key;
 	struct wl_listener on_modifiers;
+	struct wl_listener on_destroy; // Not for the group
 } Keyboard;
 
 typedef struct View {
 	struct wl_list view_layers[NUM_VIEW_LAYERS];
 	struct wl_list *layers[NUM_LAYERS];
-	void (*layout)(Output*);
-	uint32_t layer_show_mask;
+	Client_Table view_tables[NUM_VIEW_LAYERS];
+	Client_Table *tables[NUM_LAYERS];
+	void (*layout)(View*);
+	Output *output;
+	uint32_t index;
+	// Layout is kept while the view is hidden and only redone by arrange_view()
+	// when the tiles change or the usable area differs from layout_area
+	struct wlr_box layout_area;
+	uint32_t layout_dirty;
 } View;
 
 typedef struct Output {
 	struct wl_list link;
 	struct wl_list output_layers[NUM_OUTPUT_LAYERS];
-	View views[9];
+	Client_Table output_tables[NUM_OUTPUT_LAYERS];
+	// Indexed by view number. Views are allocated by get_output_view() and
+	// released by release_view_if_unused(), so most entries are NULL.
+	View **views;
+	uint32_t view_capacity;
 	uint32_t current_view;
+	uint32_t layer_show_mask;
 	uint32_t bar_height;
+	uint32_t status_generation; // status_bar.generation last drawn on this output
+	Latency_Histogram latency[NUM_LATENCY_STAGES];
+	Latency_Histogram frame_dispatch; // From the last present to handle_output_frame running
+	uint64_t present_us; // 0 if the last commit wasn't presented
+	uint64_t frame_deadline_us; // Headless only, when its frame timer is next due
+	struct wlr_damage_ring damage_ring; // What needs redrawing, in buffer coordinates
 	
 	struct wlr_output *wlr;
 	struct wl_listener on_frame;
+	struct wl_listener on_present;
 	struct wl_listener on_destroy;
 } Output;
 
@@ -309,14 +418,53 @@ static inline long next_value_in_cycle(long *cycle, long current_value) {
 	return base;
 }
 
+static inline double get_milliseconds_since(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static inline uint64_t get_monotonic_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline bool view_is_empty(const View *view) {
+	for (int i = 0; i < NUM_VIEW_LAYERS; ++i) {
+		if (!wl_list_empty(&view->view_layers[i])) return false;
+	}
+	return true;
+}
+
 static inline bool should_render_layer(View *view, enum Layer layer) {
-	return !wl_list_empty(view->layers[layer]) && (view->layer_show_mask & (1<<layer));
+	return !wl_list_empty(view->layers[layer]) && (view->output->layer_show_mask & (1<<layer));
 }
 
+static struct {
+	Pool clients;
+	Pool client_processes;
+	Pool keyboards;
+	Pool outputs;
+	Pool pointer_constraints;
+	Pool surface_watches;
+	Pool views;
+} pools = {
+	.clients = POOL_INIT(Client),
+	.client_processes = POOL_INIT(Client_Process),
+	.keyboards = POOL_INIT(Keyboard),
+	.outputs = POOL_INIT(Output),
+	.pointer_constraints = POOL_INIT(Pointer_Constraint),
+	.surface_watches = POOL_INIT(Surface_Watch),
+	.views = POOL_INIT(View),
+};
+
 static struct {
 	struct wlr_output_layout *output_layout;
 	Output *focused_output; // never NULL
 	Client *focused_client;
+	// Used to detect focused_client going stale after its Client is freed
+	Pool_Handle focused_client_handle;
 	struct {
 		uint32_t focus_grabbed : 1;
 	};
@@ -326,7 +474,6 @@ static struct {
 	// the client's top left corner
 	int32_t interact_grab_x;
 	int32_t interact_grab_y;
-	struct wl_list client_update_list;
 	
 	uint64_t time_of_last_status_update;
 	
@@ -337,6 +484,10 @@ static struct {
 	struct wl_listener on_new_output;
 	
 	struct wlr_seat *seat;
+	// Compiled once and shared by every keyboard. Keyboards with this keymap
+	// join the group, so clients only ever see the group's keyboard.
+	struct xkb_keymap *keymap;
+	struct wlr_keyboard_group *keyboard_group;
 	struct wl_listener on_request_set_cursor;
 	struct wl_listener on_request_set_selection;
     
@@ -366,6 +517,7 @@ static struct {
 	
 	struct wlr_pointer_constraints_v1 *pointer_constraints;
 	struct wl_listener on_new_pointer_constraint;
+	struct wlr_pointer_constraint_v1 *active_constraint; // Constraint of the focused surface, if any
 	
 	struct wlr_relative_pointer_manager_v1 *relative_pointer_manager;
 	
@@ -378,23 +530,76 @@ static struct {
 	struct wlr_renderer *renderer;
 	struct wlr_allocator *allocator;
 	struct wlr_compositor *compositor;
+	struct wl_listener on_new_surface;
 #if USE_XWAYLAND
 	struct wlr_xwayland *xwayland;
 	struct wl_listener on_xwayland_ready;
 	struct wl_listener on_new_xwayland_surface;
 #endif
 	struct wl_list output_list;
+	struct timespec start_time;
 } server;
 
+#include "font.c"
+
+// The oldest input that hasn't reached the screen yet
+static struct {
+	uint64_t handling_input_us; // Time of the event in the current input handler, 0 if none
+	bool pending;
+	uint64_t input_us;
+	uint64_t client_commit_us; // 0 until the focused client commits
+	Pool_Handle output; // Where the commit stages get recorded
+} input_latency;
+
+static struct {
+	bool enabled;
+	bool reported_error;
+	bool can_sys_nice; // With CAP_SYS_NICE any nice value can be set
+	Client_Process *focused;
+} client_priorities;
+
+// Programs started by spawn(), reaped when SIGCHLD comes in
+static struct {
+	pid_t *pids;
+	uint32_t count;
+	uint32_t capacity;
+} launched;
+
+#define BIND_KEY(mode, modifiers, code) (((uint64_t)(mode) << 40) | ((uint64_t)(modifiers) << 32) | (uint32_t)(code))
+#define BIND_BUTTON (1ull << 63)
+
+typedef struct {
+	uint64_t key; // BIND_KEY(), 0 for an empty slot
+	void (*function)(Input_Arg arg);
+	Input_Arg arg;
+} Bind_Slot;
+
+static struct {
+	Bind_Slot *slots;
+	uint32_t mask; // Slot count - 1, the count is a power of two
+	uint32_t mode; // Index into BIND_MODES
+} binds;
+
+static inline uint32_t hash_bind_key(uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
 #define NUM_STATUS_BLOCKS ARRAY_LENGTH(STATUS_BLOCKS)
+#define STATUS_BLOCK_MAX 128
 
+/*
+ * The block runner in status.c writes the text buffers and bumps generation
+ * whenever a block's text actually changes, which is how outputs know their
+ * bar is out of date.
+ */
 static struct {
-	char block_buffers[NUM_STATUS_BLOCKS][128];
+	char block_buffers[NUM_STATUS_BLOCKS][STATUS_BLOCK_MAX];
 	size_t block_lengths[NUM_STATUS_BLOCKS];
-	pthread_t update_thread;
-	// The status thread will only lock this when it wants
-	// to write to all of the block buffers in one motion.
-	pthread_mutex_t lock;
+	uint32_t generation;
+	struct wl_event_source *redraw_idle;
+	
+	// Labels for the first views, shaped once instead of going through the text run cache
+	Text_Run view_labels[32];
 } status_bar;
 
 // @Note: Keeping the netwm stuff here even though we don't use it right now
@@ -411,9 +616,6 @@ enum {
 static Atom NET_WM_ATOMS[NUM_NET_WM_TYPES];
 #endif
 
-#include "font.c"
-//#include "status.c"
-
 static inline void prevent_idle() {
 	wlr_idle_notifier_v1_notify_activity(server.idle_notifier, server.seat);
 	wlr_idle_notify_activity(server.idle, server.seat);
@@ -421,30 +623,91 @@ static inline void prevent_idle() {
 
 // Server functions
 static void arrange_output(Output *output);
+static void arrange_view(View *view);
+static void attach_client(Client *client, View *view, enum Layer layer);
 static void configure_client(Client *client, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t flags);
+static void detach_client(Client *client);
 static void focus_client(Client *client);
 static Client *get_client_under_cursor(Output *output);
-static Client *get_client_under_cursor_in_list(struct wlr_box *output_box, struct wl_list *list);
+static View *get_output_view(Output *output, uint32_t index);
 static void handle_destroy_surface(struct wl_listener *listener, void *data);
 static void handle_unmap_surface(struct wl_listener *listener, void *data);
 static void make_client_fullscreen(Client *client);
 static void move_client_to_layer(Client *client, enum Layer destination_layer);
+static void process_cursor_button(struct wlr_pointer_button_event *event);
+static void process_cursor_motion(struct wlr_pointer_motion_event *event);
+static void activate_pointer_constraint(struct wlr_pointer_constraint_v1 *constraint);
 static void process_cursor_move(uint32_t time_msec);
+static void process_keyboard_key(Keyboard *keyboard, struct wlr_keyboard_key_event *event);
+static void release_view_if_unused(View *view);
 static void set_cursor_mode(enum Cursor_Mode mode);
 static void send_client_close(Client *client);
+static bool try_button_bind(uint32_t modifiers, uint32_t button);
 static bool try_key_bind(uint32_t modifiers, xkb_keysym_t key);
 static void update_output_configuration(); // Disables/enables clients based on visibility
 static void update_focus();
 static void update_visibility(); // Disables/enables clients based on visibility
 
+// Input latency
+static void begin_input_latency(uint32_t time_msec);
+static void end_input_latency();
+static void add_latency_sample(Latency_Histogram *histogram, uint64_t latency_us);
+static void record_latency(Output *output, int stage, uint64_t latency_us);
+static void print_latency_histogram(const char *name, const Latency_Histogram *histogram);
+static void record_client_commit_latency(Client *client);
+static void record_output_commit_latency(Output *output);
+static int handle_latency_dump_signal(int signal_number, void *data);
+
+// Client priorities
+static void attach_client_process(Client *client); // Call on map
+static void detach_client_process(Client *client); // Call on unmap
+static void update_focused_process();
+static void update_process_priority(Client_Process *process);
+static int get_process_min_nice(pid_t pid);
+static void setup_client_priorities();
+static void setup_main_loop_scheduling(); // Only affects the calling thread
+
+// Launcher
+static void init_spawn_attributes(posix_spawnattr_t *attributes); // Undoes the event loop's signal blocking
+static pid_t launch_program(char **argv);
+static int handle_child_signal(int signal_number, void *data);
+
+// Binds
+static void add_bind(uint64_t key, void (*function)(Input_Arg), Input_Arg arg);
+static bool run_binds(uint64_t key, bool run_all);
+static void set_bind_mode(uint32_t mode); // Also redraws the bar, which shows the mode
+static void setup_binds();
+
+// Client tables
+static void client_table_finish(Client_Table *table);
+static Client *client_table_hit_test(const Client_Table *table, int32_t x, int32_t y);
+static uint32_t client_table_cull(const Client_Table *table, const struct wlr_box *box, uint8_t *restrict visible);
+static void client_table_clear_slots(Client_Table *table, uint32_t start);
+static void client_table_insert(Client_Table *table, Client *client);
+static void client_table_remove(Client_Table *table, Client *client);
+static void client_table_update(Client *client);
+
 // Client rendering
 static void render_client(Client *client, const Output *output, const float *matrix, double x_offset, double y_offset, struct timespec *when);
-static void render_client_list(struct wl_list *list, const Output *output, double x_offset, double y_offset, struct timespec *when);
+static void render_client_table(const Client_Table *table, const Output *output, double x_offset, double y_offset, struct timespec *when);
 static void render_surface(struct wlr_surface *surface, const float *matrix, double x, double y);
 
+// Frame scheduling
+static void damage_output(Output *output, const struct wlr_box *box); // NULL box for the whole output
+static void damage_all_outputs();
+static void damage_status_bars();
+static void handle_new_surface(struct wl_listener *listener, void *data);
+static void handle_set_title(struct wl_listener *listener, void *data);
+
 // Status bar
+static const Text_Run *get_view_label(uint32_t index);
 static void render_status_bar(Output *output);
-static void *status_update_thread(void *dont_care);
+static int handle_glyphs_rasterized(int fd, uint32_t mask, void *data);
+static void schedule_status_bar_frames(); // Called by status.c when block text changes
+
+#include "status.c"
+#include "trace.c"
+
 /* ================================================================================
  * Helpers
  * ================================================================================*/
@@ -454,6 +717,72 @@ static inline void set_client_box(Client *client, struct wlr_box *box, int gaps)
 					 box->width - (gaps * 2), box->height - (gaps * 2), UINT32_MAX);
 }
 
+/* ================================================================================
+ * Launcher
+ *
+ * glibc's posix_spawn uses CLONE_VM|CLONE_VFORK, so unlike fork it doesn't copy
+ * our page tables and its cost doesn't grow with the compositor's memory.
+ * ================================================================================*/
+static void init_spawn_attributes(posix_spawnattr_t *attributes) {
+	sigset_t signals;
+	
+	// The event loop blocks the signals it listens for, don't pass that on
+	posix_spawnattr_init(attributes);
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(attributes, &signals);
+	sigfillset(&signals);
+	posix_spawnattr_setsigdefault(attributes, &signals);
+	posix_spawnattr_setflags(attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+static pid_t launch_program(char **argv) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	uint64_t start = get_monotonic_us();
+	pid_t pid;
+	
+	posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+	// Most of our fds are O_CLOEXEC already, this catches anything that isn't
+	posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+	init_spawn_attributes(&attributes);
+	
+	int error = posix_spawn(&pid, argv[0], &actions, &attributes, argv, environ);
+	
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	
+	if (error) {
+		printf("Failed to launch %s: %s\n", argv[0], strerror(error));
+		return -1;
+	}
+	printf("Launched %s (pid %d) in %.2fms\n", argv[0], pid, (get_monotonic_us() - start) / 1000.0);
+	
+	if (launched.count == launched.capacity) {
+		launched.capacity = MAX(launched.capacity * 2, 16);
+		launched.pids = realloc(launched.pids, launched.capacity * sizeof(*launched.pids));
+	}
+	launched.pids[launched.count++] = pid;
+	return pid;
+}
+
+// Only reaps our own launches, status.c and Xwayland wait for their children themselves
+static int handle_child_signal(int signal_number, void *data) {
+	for (uint32_t i = 0; i < launched.count;) {
+		int status;
+		pid_t result = waitpid(launched.pids[i], &status, WNOHANG);
+		
+		if (result == 0) {
+			++i;
+			continue;
+		}
+		if (result > 0) debug_printf("Launched process %d exited with status %d\n", result, status);
+		launched.pids[i] = launched.pids[--launched.count];
+	}
+	return 0;
+}
+
 /* ================================================================================
  * Input function implementation
  * ================================================================================*/
@@ -466,6 +795,11 @@ static void close_server(Input_Arg arg) {
 	wl_display_terminate(server.display);
 }
 
+static void enter_mode(Input_Arg arg) {
+	if (arg.number < 0 || arg.number >= ARRAY_LENGTH(BIND_MODES)) return;
+	set_bind_mode(arg.number);
+}
+
 static void cycle_client_layer(Input_Arg arg) {
 	Client *client = server.focused_client;
 	if (!client) return;
@@ -474,9 +808,16 @@ static void cycle_client_layer(Input_Arg arg) {
 }
 
 static void increment_view(Input_Arg arg) {
-	uint32_t current = server.focused_output->current_view;
-	if (current + arg.number >= 9) select_view((Input_Arg){.number = 0});
-	else select_view((Input_Arg){.number = current + arg.number});
+	long next = (long)server.focused_output->current_view + arg.number;
+	long count = CONFIG.view_count;
+	
+	if (count) {
+		if (next >= count) next = 0;
+		else if (next < 0) next = count - 1;
+	}
+	else if (next < 0) next = 0;
+	
+	select_view((Input_Arg){.number = next});
 }
 
 static void move_client(Input_Arg arg) {
@@ -490,19 +831,34 @@ static void move_resize_client(Input_Arg arg) {
 static void move_to_view(Input_Arg arg) {
 	Client *client = server.focused_client;
 	if (!client) return;
-	View *dest_view = &client->output->views[arg.number];
-	if (client->view == dest_view || !client->link.next) return;
-	wl_list_remove(&client->link);
-	wl_list_insert(dest_view->layers[client->layer], &client->link);
-	client->view = dest_view;
+	if (arg.number < 0 || (CONFIG.view_count && arg.number >= CONFIG.view_count)) return;
+	if (!client->link.next || !layer_is_view_layer(client->layer)) return;
+	if (client->view->index == arg.number) return;
+	
+	View *source_view = client->view;
+	View *dest_view = get_output_view(client->output, arg.number);
+	attach_client(client, dest_view, client->layer);
+	
+	// Lay out both now so that switching to either is free
+	arrange_view(source_view);
+	arrange_view(dest_view);
+	release_view_if_unused(source_view);
+	update_visibility();
 }
 
 static void select_view(Input_Arg arg) {
 	Output *output = server.focused_output;
 	Client *client = server.focused_client;
+	View *old_view = OUTPUT_CURRENT_VIEW(output);
+	long index = MAX(arg.number, 0);
+	
+	if (CONFIG.view_count && index >= CONFIG.view_count) index = CONFIG.view_count - 1;
+	get_output_view(output, index);
+	output->current_view = index;
+	release_view_if_unused(old_view);
+	arrange_output(output);
+	damage_output(output, NULL);
 	
-	output->current_view = arg.number;
-	if (output->current_view >= 9) output->current_view = 8;
 	if (client && layer_is_view_layer(client->layer)) focus_client(NULL);
 	update_focus();
 	update_visibility();
@@ -516,15 +872,14 @@ static void set_client_layer(Input_Arg arg) {
 
 static void set_layout(Input_Arg arg) {
 	Output *output = server.focused_output;
-	View *view = &output->views[output->current_view];
+	View *view = OUTPUT_CURRENT_VIEW(output);
 	view->layout = arg.layout;
-	arrange_output(output);
+	view->layout_dirty = 1;
+	arrange_view(view);
 }
 
 static void spawn(Input_Arg arg) {
-	if (fork() == 0) {
-		execv(arg.argv[0], arg.argv);
-	}
+	launch_program(arg.argv);
 }
 
 static void toggle_fullscreen(Input_Arg arg) {
@@ -539,29 +894,25 @@ static void toggle_fullscreen(Input_Arg arg) {
 		move_client_to_layer(client, LAYER_VIEW_FULLSCREEN);
 	} else {
 		move_client_to_layer(client, client->old_layer);
-		arrange_output(client->output);
 	}
 }
 
 static void toggle_layer(Input_Arg arg) {
 	Output *output = server.focused_output;
-	View *view = output->views;
-	uint32_t layer_bit = 1u << (uint32_t)arg.number;
-	for (int i = 0; i < 9; ++i, ++view) {
-		view->layer_show_mask ^= layer_bit;
-	}
+	output->layer_show_mask ^= 1u << (uint32_t)arg.number;
+	damage_output(output, NULL);
+	update_visibility();
 }
 
 /* ================================================================================
  * Layouts
  * ================================================================================*/
-static void layout_recursive(Output *output) {
-	struct wl_list *tiles = output->views[output->current_view].layers[LAYER_VIEW_TILES];
-	struct wlr_box usable_area;
+static void layout_recursive(View *view) {
+	struct wl_list *tiles = view->layers[LAYER_VIEW_TILES];
+	struct wlr_box usable_area = view->layout_area;
 	uint32_t count = wl_list_length(tiles);
 	if (!count) return;
 	
-	get_output_client_area(output, &usable_area);
 	uint32_t i = 1;
 	const uint32_t gaps = CONFIG.gap_size;
 	Client *client;
@@ -647,13 +998,24 @@ static void render_client(Client *client, const Output *output, const float *mat
 #endif
 }
 
-static void render_client_list(struct wl_list *list, const Output *output, double x_offset, double y_offset, struct timespec *when) {
-	Client *client;
+static void render_client_table(const Client_Table *table, const Output *output, double x_offset, double y_offset, struct timespec *when) {
 	float matrix[9];
+	uint8_t visible[table->capacity ? table->capacity : 1];
+	struct wlr_box output_box;
+	
+	if (!table->count) return;
 	memcpy(matrix, output->wlr->transform_matrix, sizeof(matrix));
+	
+	// Cull in the table's coordinates, leaving room for borders
+	wlr_output_effective_resolution(output->wlr, &output_box.width, &output_box.height);
+	output_box.x = -x_offset - CONFIG.border_pixels;
+	output_box.y = -y_offset - CONFIG.border_pixels;
+	output_box.width += CONFIG.border_pixels*2;
+	output_box.height += CONFIG.border_pixels*2;
+	if (!client_table_cull(table, &output_box, visible)) return;
     
-	wl_list_for_each_reverse(client, list, link) {
-		render_client(client, output, matrix, x_offset, y_offset, when);
+	for (uint32_t i = 0; i < table->count; ++i) {
+		if (visible[i]) render_client(table->clients[i], output, matrix, x_offset, y_offset, when);
 	}
 }
 
@@ -663,54 +1025,80 @@ static void render_surface(struct wlr_surface *surface, const float *matrix, dou
 	wlr_render_texture(server.renderer, texture, matrix, x, y, 1.f);
 }
 
+/* ================================================================================
+ * Frame scheduling
+ *
+ * Outputs only render when something on them may have changed. Changes are
+ * added to the output's damage ring and a frame is scheduled; an output with
+ * nothing damaged skips rendering and committing, and then stops getting
+ * frames until the next damage. Surface commits and layout, focus and view
+ * changes damage whole outputs. Status bar updates only damage the bar.
+ * ================================================================================*/
+static void damage_output(Output *output, const struct wlr_box *box) {
+	if (box) wlr_damage_ring_add_box(&output->damage_ring, box);
+	else wlr_damage_ring_add_whole(&output->damage_ring);
+	wlr_output_schedule_frame(output->wlr);
+}
+
+static void damage_all_outputs() {
+	Output *output;
+	wl_list_for_each(output, &server.output_list, link) {
+		damage_output(output, NULL);
+	}
+}
+
+// For when the bar's content changed but not the status blocks
+static void damage_status_bars() {
+	status_bar.generation++;
+	schedule_status_bar_frames();
+}
+
+static void handle_surface_watch_commit(struct wl_listener *listener, void *data) {
+	damage_all_outputs();
+}
+
+static void handle_surface_watch_destroy(struct wl_listener *listener, void *data) {
+	Surface_Watch *watch = wl_container_of(listener, watch, on_destroy);
+	wl_list_remove(&watch->on_commit.link);
+	wl_list_remove(&watch->on_destroy.link);
+	pool_free(&pools.surface_watches, watch);
+	damage_all_outputs();
+}
+
+// Covers subsurfaces, popups and cursor and drag icons too, not just clients
+static void handle_new_surface(struct wl_listener *listener, void *data) {
+	struct wlr_surface *surface = data;
+	Surface_Watch *watch = pool_alloc(&pools.surface_watches);
+	listen(&watch->on_commit, &handle_surface_watch_commit, &surface->events.commit);
+	listen(&watch->on_destroy, &handle_surface_watch_destroy, &surface->events.destroy);
+}
+
+// The bar shows the focused client's title
+static void handle_set_title(struct wl_listener *listener, void *data) {
+	Client *client = wl_container_of(listener, client, on_set_title);
+	if (client == server.focused_client) damage_status_bars();
+}
+
 /* ================================================================================
  * Status bar
  * ================================================================================*/
-static void *status_update_thread(void *dont_care) {
-	char buffers[NUM_STATUS_BLOCKS][128];
-	FILE *pipes[NUM_STATUS_BLOCKS];
+static const Text_Run *get_view_label(uint32_t index) {
+	Text_Run *label = index < ARRAY_LENGTH(status_bar.view_labels) ? &status_bar.view_labels[index] : NULL;
+	char string[16];
+	size_t length;
 	
-	for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
-	}
+	if (label && label->string && label->font_generation == bar_font.generation) return label;
 	
-	while (1) {
-		for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
-			pipes[i] = popen(STATUS_BLOCKS[i], "r");
-		}
-		
-		for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
-			if (pipes[i]) {
-				fread(buffers[i], sizeof(buffers[i])-1, 1, pipes[i]);
-				pclose(pipes[i]);
-			}
-		}
-		
-		pthread_mutex_lock(&status_bar.lock);
-		for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
-			if (!pipes[i]) continue;
-			memset(status_bar.block_buffers[i], 0, sizeof(status_bar.block_buffers[i]));
-			char *in = buffers[i], *out = status_bar.block_buffers[i];
-			size_t length = 0;
-			
-			for (length = 0; 
-				 (length < (sizeof(buffers[i])-1)) && *in && (*in != '\n'); 
-				 ++length, ++in, ++out) {
-				*out = *in;
-			}
-			status_bar.block_lengths[i] = length;
-		}
-		pthread_mutex_unlock(&status_bar.lock);
-        
-		printf("Nunights\n");
-		sleep(CONFIG.status_update_interval_seconds);
-		printf("Wake up\n");
-	}
-	return NULL;
+	snprintf(string, sizeof(string), "%u", index + 1);
+	if (!label) return get_text_run(string);
+	
+	uint64_t hash = hash_string(string, &length);
+	shape_text_run(label, string, length, hash);
+	return label;
 }
 
 static void render_status_bar(Output *output) {
 	char text_buffer[256];
-	Glyph glyph_buffer[256];
 	struct wlr_box draw_rect;
 	struct wlr_box output_box;
 	float matrix[9];
@@ -737,23 +1125,26 @@ static void render_status_bar(Output *output) {
 	const int view_indicator_padding = 10;
 	int x_offset = view_indicator_padding;
 	
-	for (int i = 0; i < 9; ++i) {
-		char string[2] = {'1' + i, 0};
-		Glyph glyph;
-		View *view = &output->views[i];
+	// With no view limit, only show views that exist
+	uint32_t view_indicator_count = CONFIG.view_count ? CONFIG.view_count : output->view_capacity;
+	
+	for (uint32_t i = 0; i < view_indicator_count; ++i) {
+		View *view = i < output->view_capacity ? output->views[i] : NULL;
 		
-		get_string_glyphs(string, &glyph, NULL);
+		if (!CONFIG.view_count && !view) continue;
+		
+		const Text_Run *label = get_view_label(i);
+		int width = label->advance;
 		
 		if (output->current_view == i) {
 			draw_rect.x = x_offset - (view_indicator_padding/2);
 			draw_rect.y = 0;
-			draw_rect.width = glyph.width + view_indicator_padding;
+			draw_rect.width = width + view_indicator_padding;
 			draw_rect.height = output->bar_height;
 			wlr_render_rect(server.renderer, &draw_rect, CONFIG.bar_selection_color, matrix);
 		}
         
-		if (!wl_list_empty(view->layers[LAYER_VIEW_FLOATING]) || !wl_list_empty(view->layers[LAYER_VIEW_TILES]) ||
-			!wl_list_empty(view->layers[LAYER_VIEW_FULLSCREEN])) {
+		if (view && !view_is_empty(view)) {
 			draw_rect.x = x_offset - view_indicator_padding/2 + 1;
 			draw_rect.y = 1;
 			draw_rect.width = 2;
@@ -761,34 +1152,31 @@ static void render_status_bar(Output *output) {
 			wlr_render_rect(server.renderer, &draw_rect, (float[]){1,1,1,1}, matrix);
 		}
 		
-		x_offset += render_glyphs(matrix, &glyph, 1, x_offset, text_y) + view_indicator_padding;
+		x_offset += render_text_run(matrix, label, x_offset, text_y) + view_indicator_padding;
 	}
 	
 	// Gap to client title
 	x_offset += 30;
 	
+	if (binds.mode) {
+		x_offset += render_text_run(matrix, get_text_run(BIND_MODES[binds.mode].name), x_offset, text_y) + 30;
+	}
+	
 	// Print focused client name
 	if (server.focused_client) {
 		const char *client_title = get_client_title(server.focused_client);
-		size_t client_title_length;
 		snprintf(text_buffer, sizeof(text_buffer), "%s [%d]", client_title, server.focused_client->layer);
-		get_string_glyphs(text_buffer, glyph_buffer, &client_title_length);
-		render_glyphs(matrix, glyph_buffer, client_title_length, x_offset, text_y);
+		render_text_run(matrix, get_text_run(text_buffer), x_offset, text_y);
 	}
 	
 	// Status blocks
-	Glyph status_glyph_buffer[ARRAY_LENGTH(STATUS_BLOCKS)][128];
-	
-	size_t block_draw_lengths[NUM_STATUS_BLOCKS];
+	output->status_generation = status_bar.generation;
 	x_offset = output_box.width - CONFIG.status_padding;
 	
-	pthread_mutex_lock(&status_bar.lock);
-	for (int i = 0; i < ARRAY_LENGTH(STATUS_BLOCKS); ++i) {
-		size_t string_length = status_bar.block_lengths[i];
-		block_draw_lengths[i] = get_string_glyphs(status_bar.block_buffers[i], status_glyph_buffer[i], NULL);
-		
-		x_offset -= block_draw_lengths[i];
-		render_glyphs(matrix, status_glyph_buffer[i], string_length, x_offset, text_y);
+	for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
+		const Text_Run *run = get_text_run(status_bar.block_buffers[i]);
+		x_offset -= run->advance;
+		render_text_run(matrix, run, x_offset, text_y);
 		x_offset -= CONFIG.status_padding;
 		
 		draw_rect.x = x_offset;
@@ -798,18 +1186,253 @@ static void render_status_bar(Output *output) {
 		wlr_render_rect(server.renderer, &draw_rect, CONFIG.status_separator_color, matrix);
 		x_offset -= CONFIG.status_padding + draw_rect.width;
 	}
-	pthread_mutex_unlock(&status_bar.lock);
+}
+
+static void handle_status_bar_changed(void *data) {
+	Output *output;
+	status_bar.redraw_idle = NULL;
+	
+	wl_list_for_each(output, &server.output_list, link) {
+		View *view = OUTPUT_CURRENT_VIEW(output);
+		if (!output->wlr->enabled || !output->bar_height) continue;
+		// Covered by a fullscreen client or already showing this text
+		if (!wl_list_empty(view->layers[LAYER_VIEW_FULLSCREEN])) continue;
+		if (output->status_generation == status_bar.generation) continue;
+		
+		// The bar is at the top of the buffer unless the output is transformed or scaled
+		struct wlr_box bar_box = {0, 0, output->wlr->width, output->bar_height};
+		bool untransformed = output->wlr->transform == WL_OUTPUT_TRANSFORM_NORMAL && output->wlr->scale == 1;
+		damage_output(output, untransformed ? &bar_box : NULL);
+	}
+}
+
+static void set_bind_mode(uint32_t mode) {
+	if (binds.mode == mode) return;
+	binds.mode = mode;
+	// The mode name is on the bar
+	damage_status_bars();
+}
+
+// Glyphs that were pending drew as nothing, so every bar needs redrawing
+static int handle_glyphs_rasterized(int fd, uint32_t mask, void *data) {
+	if (upload_rasterized_glyphs()) damage_status_bars();
+	return 0;
+}
+
+// Block updates from one loop iteration are coalesced into one frame per output
+static void schedule_status_bar_frames() {
+	if (status_bar.redraw_idle) return;
+	status_bar.redraw_idle = wl_event_loop_add_idle(wl_display_get_event_loop(server.display), &handle_status_bar_changed, NULL);
+}
+
+/* ================================================================================
+ * Client tables
+ * ================================================================================*/
+static void client_table_finish(Client_Table *table) {
+	free(table->x);
+	free(table->y);
+	free(table->width);
+	free(table->height);
+	free(table->flags);
+	free(table->clients);
+	memset(table, 0, sizeof(*table));
+}
+
+// Returns the top-most client containing the point, in output coordinates
+static Client *client_table_hit_test(const Client_Table *table, int32_t x, int32_t y) {
+	// Scan down from the top in whole blocks. Within a block there is no early
+	// out, so that the compiler can vectorize it; between blocks there is, since
+	// the top of the stack usually covers the point. Empty slots are never hit.
+	uint32_t end = (table->count + CLIENT_TABLE_BLOCK - 1) / CLIENT_TABLE_BLOCK * CLIENT_TABLE_BLOCK;
+	for (; end > 0; end -= CLIENT_TABLE_BLOCK) {
+		uint32_t start = end - CLIENT_TABLE_BLOCK;
+		const int32_t *block_x = table->x + start, *block_y = table->y + start;
+		const int32_t *width = table->width + start, *height = table->height + start;
+		int32_t hit = -1;
+		
+		for (int i = 0; i < CLIENT_TABLE_BLOCK; ++i) {
+			uint32_t dx = (uint32_t)(x - block_x[i]);
+			uint32_t dy = (uint32_t)(y - block_y[i]);
+			bool inside = (dx < (uint32_t)width[i]) & (dy < (uint32_t)height[i]);
+			hit = inside ? i : hit;
+		}
+		
+		if (hit >= 0) return table->clients[start + hit];
+	}
+	
+	return NULL;
+}
+
+// Sets visible[i] to whether entry i overlaps box, for whole blocks, so visible
+// needs room for the table's capacity. Returns the number of visible entries.
+static uint32_t client_table_cull(const Client_Table *table, const struct wlr_box *box, uint8_t *restrict visible) {
+	const int32_t x1 = box->x, y1 = box->y;
+	const int32_t x2 = box->x + box->width, y2 = box->y + box->height;
+	uint32_t count = 0;
+	
+	// A fixed trip count lets -O2 vectorize the block without a scalar epilogue.
+	// Empty slots at the end of the last block never overlap anything.
+	for (uint32_t start = 0; start < table->count; start += CLIENT_TABLE_BLOCK) {
+		const int32_t *x = table->x + start, *y = table->y + start;
+		const int32_t *width = table->width + start, *height = table->height + start;
+		uint8_t *block_visible = visible + start;
+		int32_t block_count = 0;
+		
+		for (int i = 0; i < CLIENT_TABLE_BLOCK; ++i) {
+			int32_t inside = (x[i] < x2) & (x[i] + width[i] > x1) & (y[i] < y2) & (y[i] + height[i] > y1);
+			block_visible[i] = inside;
+			block_count += inside;
+		}
+		count += block_count;
+	}
+	
+	return count;
+}
+
+// Empty slots sit at INT32_MAX with no size, where no box can reach them
+static void client_table_clear_slots(Client_Table *table, uint32_t start) {
+	for (uint32_t i = start; i < table->capacity; ++i) {
+		table->x[i] = table->y[i] = INT32_MAX;
+		table->width[i] = table->height[i] = 0;
+	}
+}
+
+static void client_table_insert(Client_Table *table, Client *client) {
+	if (table->count == table->capacity) {
+		table->capacity = table->capacity ? table->capacity * 2 : CLIENT_TABLE_BLOCK;
+		table->x = realloc(table->x, table->capacity * sizeof(*table->x));
+		table->y = realloc(table->y, table->capacity * sizeof(*table->y));
+		table->width = realloc(table->width, table->capacity * sizeof(*table->width));
+		table->height = realloc(table->height, table->capacity * sizeof(*table->height));
+		table->flags = realloc(table->flags, table->capacity * sizeof(*table->flags));
+		table->clients = realloc(table->clients, table->capacity * sizeof(*table->clients));
+		client_table_clear_slots(table, table->count);
+	}
+	
+	client->table = table;
+	client->table_index = table->count++;
+	table->clients[client->table_index] = client;
+	client_table_update(client);
+}
+
+static void client_table_remove(Client_Table *table, Client *client) {
+	uint32_t index = client->table_index;
+	uint32_t move_count = table->count - index - 1;
+	assert(table->clients[index] == client);
+	
+	// Shift down to keep stacking order
+	memmove(&table->x[index], &table->x[index + 1], move_count * sizeof(*table->x));
+	memmove(&table->y[index], &table->y[index + 1], move_count * sizeof(*table->y));
+	memmove(&table->width[index], &table->width[index + 1], move_count * sizeof(*table->width));
+	memmove(&table->height[index], &table->height[index + 1], move_count * sizeof(*table->height));
+	memmove(&table->flags[index], &table->flags[index + 1], move_count * sizeof(*table->flags));
+	memmove(&table->clients[index], &table->clients[index + 1], move_count * sizeof(*table->clients));
+	table->count--;
+	client_table_clear_slots(table, table->count);
+	
+	for (uint32_t i = index; i < table->count; ++i) {
+		table->clients[i]->table_index = i;
+	}
+	
+	client->table = NULL;
+}
+
+static void client_table_update(Client *client) {
+	Client_Table *table = client->table;
+	uint32_t i = client->table_index;
+	struct wlr_surface *wlr_surface = get_client_wlr_surface(client);
+	
+	table->x[i] = client->config.x;
+	table->y[i] = client->config.y;
+	table->width[i] = wlr_surface ? wlr_surface->current.width : 0;
+	table->height[i] = wlr_surface ? wlr_surface->current.height : 0;
+	table->flags[i] = client->config.flags;
 }
 
 /* ================================================================================
  * Server functions
  * ================================================================================*/
 static void arrange_output(Output *output) {
-	View *view = &output->views[output->current_view];
-	view->layout(output);
+	arrange_view(OUTPUT_CURRENT_VIEW(output));
+}
+
+static void arrange_view(View *view) {
+	struct wlr_box area;
+	get_output_client_area(view->output, &area);
+	
+	if (!view->layout_dirty && !memcmp(&area, &view->layout_area, sizeof(area))) return;
+	
+	view->layout_area = area;
+	view->layout_dirty = 0;
+	view->layout(view);
+}
+
+// Puts the client on top of a layer list and its table
+static void attach_client(Client *client, View *view, enum Layer layer) {
+	detach_client(client);
+	client->view = view;
+	client->layer = layer;
+	if (layer == LAYER_VIEW_TILES) view->layout_dirty = 1;
+	wl_list_insert(view->layers[layer], &client->link);
+	client_table_insert(view->tables[layer], client);
+	damage_all_outputs();
+}
+
+static void detach_client(Client *client) {
+	if (!client->link.next) return;
+	if (client->layer == LAYER_VIEW_TILES) client->view->layout_dirty = 1;
+	wl_list_remove(&client->link);
+	client_table_remove(client->table, client);
+	client->view = NULL;
+	damage_all_outputs();
+}
+
+static View *get_output_view(Output *output, uint32_t index) {
+	if (index >= output->view_capacity) {
+		uint32_t new_capacity = MAX(index + 1, output->view_capacity * 2);
+		output->views = realloc(output->views, new_capacity * sizeof(*output->views));
+		memset(&output->views[output->view_capacity], 0, 
+			   (new_capacity - output->view_capacity) * sizeof(*output->views));
+		output->view_capacity = new_capacity;
+	}
+	
+	View *view = output->views[index];
+	if (view) return view;
+	
+	view = pool_alloc(&pools.views);
+	view->output = output;
+	view->index = index;
+	view->layout = LAYOUT_DEFAULT;
+	
+	for (int i = 0; i < NUM_VIEW_LAYERS; ++i)
+		wl_list_init(&view->view_layers[i]);
+	
+	view->layers[LAYER_OUTPUT_BACKGROUND] = &output->output_layers[OUTPUT_LAYER_BACKGROUND];
+	view->layers[LAYER_OUTPUT_BOTTOM] = &output->output_layers[OUTPUT_LAYER_BOTTOM];
+	view->layers[LAYER_VIEW_TILES] = &view->view_layers[VIEW_LAYER_TILES];
+	view->layers[LAYER_VIEW_FLOATING] = &view->view_layers[VIEW_LAYER_FLOATING];
+	view->layers[LAYER_VIEW_FULLSCREEN] = &view->view_layers[VIEW_LAYER_FULLSCREEN];
+	view->layers[LAYER_OUTPUT_POPUPS] = &output->output_layers[OUTPUT_LAYER_POPUPS];
+	view->layers[LAYER_OUTPUT_STICKY] = &output->output_layers[OUTPUT_LAYER_STICKY];
+	view->layers[LAYER_OUTPUT_TOP] = &output->output_layers[OUTPUT_LAYER_TOP];
+	view->layers[LAYER_OUTPUT_OVERLAY] = &output->output_layers[OUTPUT_LAYER_OVERLAY];
+	
+	view->tables[LAYER_OUTPUT_BACKGROUND] = &output->output_tables[OUTPUT_LAYER_BACKGROUND];
+	view->tables[LAYER_OUTPUT_BOTTOM] = &output->output_tables[OUTPUT_LAYER_BOTTOM];
+	view->tables[LAYER_VIEW_TILES] = &view->view_tables[VIEW_LAYER_TILES];
+	view->tables[LAYER_VIEW_FLOATING] = &view->view_tables[VIEW_LAYER_FLOATING];
+	view->tables[LAYER_VIEW_FULLSCREEN] = &view->view_tables[VIEW_LAYER_FULLSCREEN];
+	view->tables[LAYER_OUTPUT_POPUPS] = &output->output_tables[OUTPUT_LAYER_POPUPS];
+	view->tables[LAYER_OUTPUT_STICKY] = &output->output_tables[OUTPUT_LAYER_STICKY];
+	view->tables[LAYER_OUTPUT_TOP] = &output->output_tables[OUTPUT_LAYER_TOP];
+	view->tables[LAYER_OUTPUT_OVERLAY] = &output->output_tables[OUTPUT_LAYER_OVERLAY];
+	
+	output->views[index] = view;
+	return view;
 }
 
 static void configure_client(Client *client, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t flags) {
+	bool resize = width != INT32_MAX || height != INT32_MAX;
 	if (x == INT32_MAX) x = client->config.x;
 	if (y == INT32_MAX) y = client->config.y;
 	if (width == INT32_MAX) width = client->config.width;
@@ -818,9 +1441,23 @@ static void configure_client(Client *client, int32_t x, int32_t y, int32_t width
 	
 	switch (client->type) {
 		case CLIENT_TYPE_XDG_TOPLEVEL: {
+			// Position is ours alone, so only configure when the client would
+			// actually have to reallocate or change state. Clients can commit
+			// another size on their own, so compare against what they have, unless
+			// they're still answering a configure with this size.
 			struct wlr_xdg_toplevel *toplevel = client->xdg_surface->toplevel;
-			wlr_xdg_toplevel_set_size(toplevel, width, height);
-			wlr_xdg_toplevel_set_fullscreen(toplevel, (flags & CLIENT_CONFIG_FULLSCREEN) != 0);
+			if (resize) {
+				struct wlr_box geometry;
+				wlr_xdg_surface_get_geometry(client->xdg_surface, &geometry);
+				bool scheduled = width == toplevel->scheduled.width && height == toplevel->scheduled.height;
+				bool awaiting_ack = !wl_list_empty(&client->xdg_surface->configure_list);
+				if (!scheduled || (!awaiting_ack && (width != geometry.width || height != geometry.height))) {
+					wlr_xdg_toplevel_set_size(toplevel, width, height);
+				}
+			}
+			if ((flags ^ client->config.flags) & CLIENT_CONFIG_FULLSCREEN) {
+				wlr_xdg_toplevel_set_fullscreen(toplevel, (flags & CLIENT_CONFIG_FULLSCREEN) != 0);
+			}
 			break;
 		}
 #if USE_XWAYLAND
@@ -849,10 +1486,14 @@ static void configure_client(Client *client, int32_t x, int32_t y, int32_t width
 	client->config.width = width;
 	client->config.height = height;
 	client->config.flags = flags;
+	
+	if (client->table) client_table_update(client);
+	damage_all_outputs();
 }
 
 static void focus_client(Client *client) {
 	if (server.focus_grabbed || (client && client == server.focused_client)) return;
+	damage_all_outputs(); // Borders and the title on the bar
 	
 	if (server.focused_client) {
 		Client *old_client = server.focused_client;
@@ -867,17 +1508,13 @@ static void focus_client(Client *client) {
 			wlr_xwayland_surface_activate(old_client->xwayland_surface, false);
 		}
 #endif
-		struct wlr_surface *wlr_surface = get_client_wlr_surface(old_client);
-		struct wlr_pointer_constraint_v1 *constraint = 
-			wlr_pointer_constraints_v1_constraint_for_surface(server.pointer_constraints, wlr_surface, server.seat);
-		if (constraint) {
-			printf("Satistfactory\n");
-			wlr_pointer_constraint_v1_send_deactivated(constraint);
-		}
+		activate_pointer_constraint(NULL);
 	}
 	
 	if (!client) {
 		server.focused_client = NULL; 
+		server.focused_client_handle = pool_get_handle(NULL);
+		update_focused_process();
 		return;
 	}
     
@@ -907,6 +1544,10 @@ static void focus_client(Client *client) {
 	}
 	
 	server.focused_client = client;
+	server.focused_client_handle = pool_get_handle(client);
+	update_focused_process();
+	activate_pointer_constraint(wlr_pointer_constraints_v1_constraint_for_surface(server.pointer_constraints, 
+																				   client_surface, server.seat));
 }
 
 static Client *get_client_under_cursor(Output *focused_output) {
@@ -926,17 +1567,20 @@ static Client *get_client_under_cursor(Output *focused_output) {
 	};
 	
 	
+	// @TODO: Hit test children of the client first
 	for (int i = 0; i < ARRAY_LENGTH(search_order); ++i) {
 		Output *output;
 		wl_list_for_each(output, &server.output_list, link) {
-			View *view = &output->views[output->current_view];
+			View *view = OUTPUT_CURRENT_VIEW(output);
 			int min_layer = !wl_list_empty(view->layers[LAYER_VIEW_FULLSCREEN]) ? LAYER_VIEW_FULLSCREEN : 0;
             
 			wlr_output_layout_get_box(server.output_layout, output->wlr, &output_box);
 			int layer = search_order[i];
 			if (layer < min_layer) break;
 			if (!should_render_layer(view, layer)) continue;
-			client = get_client_under_cursor_in_list(&output_box, view->layers[layer]);
+			client = client_table_hit_test(view->tables[layer], 
+										   floor(server.cursor->x) - output_box.x, 
+										   floor(server.cursor->y) - output_box.y);
 			if (client) return client;
 		}
 	}
@@ -944,61 +1588,79 @@ static Client *get_client_under_cursor(Output *focused_output) {
 	return NULL;
 }
 
-// @TODO: Iterate over children of the client first
-static Client *get_client_under_cursor_in_list(struct wlr_box *output_box, struct wl_list *list) {
-	Client *client;
-	
-	if (wl_list_empty(list)) return NULL;
+static void handle_destroy_surface(struct wl_listener *listener, void *data) {
+	Client *client = wl_container_of(listener, client, on_destroy);
+	struct wl_listener *listeners[] = {
+		&client->on_commit, &client->on_destroy, &client->on_map, &client->on_request_configure,
+		&client->on_request_fullscreen, &client->on_request_minimize, &client->on_set_title, &client->on_unmap,
+	};
 	
-	wl_list_for_each(client, list, link) {
-		struct wlr_surface *client_surface = get_client_wlr_surface(client);
-		struct wlr_box client_box = {
-			.x = client->config.x + output_box->x,
-			.y = client->config.y + output_box->y,
-			.width = client_surface->current.width,
-			.height = client_surface->current.height,
-		};
-		
-		if (wlr_box_contains_point(&client_box, server.cursor->x, server.cursor->y)) {
-			return client;
-		}
+	// The slot gets reused, so don't leave it linked into the surface's signals
+	for (int i = 0; i < ARRAY_LENGTH(listeners); ++i) {
+		if (listeners[i]->link.next) wl_list_remove(&listeners[i]->link);
 	}
+	detach_client_process(client);
+	pool_free(&pools.clients, client);
 	
-	return NULL;
-}
-
-static void handle_destroy_surface(struct wl_listener *listener, void *data) {
-	Client *client = wl_container_of(listener, client, on_destroy);
-	free(client);
+	if (server.focused_client && !pool_resolve(&pools.clients, server.focused_client_handle)) {
+		debug_printf("Focused client %p was destroyed while focused\n", server.focused_client);
+		server.focused_client = NULL;
+		server.focus_grabbed = 0;
+		update_focused_process();
+	}
 }
 
 static void handle_unmap_surface(struct wl_listener *listener, void *data) {
 	Client *client = wl_container_of(listener, client, on_unmap);
+	if (client->awaiting_output) {
+		client->awaiting_output = 0;
+		return;
+	}
 	if (client == server.focused_client) {
 		server.focus_grabbed = 0;
 		focus_client(NULL);
 	}
-	if (client->link.next) wl_list_remove(&client->link);
-	arrange_output(client->output);
-	if (client->update_link.next) wl_list_remove(&client->update_link);
+	View *view = client->view;
+	detach_client(client);
+	if (client->on_commit.link.next) wl_list_remove(&client->on_commit.link);
+	detach_client_process(client);
+	if (view) {
+		arrange_view(view);
+		release_view_if_unused(view);
+	}
 	
 	client->mapped = 0;
 }
 
+static void handle_surface_commit(struct wl_listener *listener, void *data) {
+	Client *client = wl_container_of(listener, client, on_commit);
+	if (client->table) client_table_update(client);
+	record_client_commit_latency(client);
+}
+
 static void handle_map_surface(struct wl_listener *listener, void *data) {
 	Client *client = wl_container_of(listener, client, on_map);
 	Output *output = client->output ? client->output : server.focused_output;
-	View *view = client->view ? client->view : &output->views[output->current_view];
+	
+	// Every output is gone, so there's no view to put it on yet
+	if (!output) {
+		client->awaiting_output = 1;
+		return;
+	}
+	View *view = client->view ? client->view : OUTPUT_CURRENT_VIEW(output);
 	
 	client->mapped = 1;
+	client->visible = 1;
 	client->output = output;
 	client->view = view;
+	listen(&client->on_commit, &handle_surface_commit, &get_client_wlr_surface(client)->events.commit);
 	
 	if (client->type == CLIENT_TYPE_XDG_TOPLEVEL) {
-		wl_list_insert(&server.client_update_list, &client->update_link);
 		client->layer = LAYER_VIEW_TILES;
-		// If its a popup we don't care because it will still be rendered
+		// If its a popup we don't care because it will still be rendered.
+		// It's never attached, so it mustn't keep a view that can be freed under it.
 		if (client->xdg_surface->role == WLR_XDG_SURFACE_ROLE_POPUP) {
+			client->view = NULL;
 			return;
 		}
         
@@ -1007,10 +1669,10 @@ static void handle_map_surface(struct wl_listener *listener, void *data) {
 		}
         
 		wlr_xdg_toplevel_set_activated(client->xdg_surface->toplevel, true);
+		attach_client_process(client);
 	}
 #if USE_XWAYLAND
 	else if (client->type == CLIENT_TYPE_XWAYLAND) {
-		wl_list_insert(&server.client_update_list, &client->update_link);
 		struct wlr_xwayland_surface *surface = client->xwayland_surface;
 		printf("Map XWayland surface %s (%p) (override_redirect = %d modal = %d)\n", 
 			   get_client_title(client), client, surface->override_redirect, surface->modal);
@@ -1056,9 +1718,8 @@ static void handle_map_surface(struct wl_listener *listener, void *data) {
 #else
 			if (!wlr_xwayland_or_surface_wants_focus(client->xwayland_surface)) {
 				configure_client(client, surface->x, surface->y, surface->width, surface->height, 0);
-				client->layer = LAYER_OUTPUT_POPUPS;
 				client->old_layer = LAYER_OUTPUT_POPUPS;
-				wl_list_insert(view->layers[LAYER_OUTPUT_POPUPS], &client->link);
+				attach_client(client, view, LAYER_OUTPUT_POPUPS);
 				return;
 			}
 #endif		
@@ -1082,7 +1743,7 @@ static void handle_map_surface(struct wl_listener *listener, void *data) {
 	else if (client->type == CLIENT_TYPE_LAYER) {
 		struct wlr_layer_surface_v1 *layer_surface = client->layer_surface;
 		output = layer_surface->output ? layer_surface->output->data : server.focused_output;
-		view = &output->views[output->current_view];
+		view = OUTPUT_CURRENT_VIEW(output);
 		
 		enum Layer layer_map[] = {
 			[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND] = LAYER_OUTPUT_BACKGROUND,
@@ -1105,7 +1766,7 @@ static void handle_map_surface(struct wl_listener *listener, void *data) {
 									   layer_surface->pending.actual_width, 
 									   layer_surface->pending.actual_height);
 		
-		wl_list_insert(view->layers[client->layer], &client->link);
+		attach_client(client, view, client->layer);
 		
 		if (layer_surface->current.keyboard_interactive != ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE) {
 			focus_client(client);
@@ -1114,23 +1775,41 @@ static void handle_map_surface(struct wl_listener *listener, void *data) {
 		return;
 	}
 	
-	wl_list_insert(view->layers[client->layer], &client->link);
-	if (client->layer == LAYER_VIEW_TILES) arrange_output(output);
+	attach_client(client, view, client->layer);
+	arrange_view(view);
 	focus_client(client);
 }
 
 static void move_client_to_layer(Client *client, enum Layer dest_layer) {
 	Output *output = client->output;
-	View *view = &output->views[output->current_view];
-	struct wl_list *dest_list = view->layers[dest_layer];
+	View *view = OUTPUT_CURRENT_VIEW(output);
+	View *source_view = client->view;
 	
-	if (client->link.next) wl_list_remove(&client->link);
-	wl_list_insert(dest_list, &client->link);
+	client->old_layer = client->layer;
+	attach_client(client, view, dest_layer);
 	
-	if (dest_layer == LAYER_VIEW_TILES) arrange_output(output);
+	if (source_view && source_view != view) arrange_view(source_view);
+	arrange_view(view);
+	if (dest_layer == LAYER_VIEW_FULLSCREEN || client->old_layer == LAYER_VIEW_FULLSCREEN) update_visibility();
+}
+
+// Frees a view once it has no clients and isn't being shown
+static void release_view_if_unused(View *view) {
+	Output *output = view->output;
+	if (view->index == output->current_view || !view_is_empty(view)) return;
 	
-	client->old_layer = client->layer;
-	client->layer = dest_layer;
+	// Clients on output layers still point at the view they were mapped on
+	for (int i = 0; i < NUM_OUTPUT_LAYERS; ++i) {
+		Client *client;
+		wl_list_for_each(client, &output->output_layers[i], link) {
+			if (client->view == view) client->view = OUTPUT_CURRENT_VIEW(output);
+		}
+	}
+	
+	for (int i = 0; i < NUM_VIEW_LAYERS; ++i) 
+		client_table_finish(&view->view_tables[i]);
+	output->views[view->index] = NULL;
+	pool_free(&pools.views, view);
 }
 
 static void process_cursor_move(uint32_t time_msec) {
@@ -1172,17 +1851,18 @@ static void process_cursor_move(uint32_t time_msec) {
         
 		if (output != client->output) {
 			struct wlr_box old_output;
+			View *old_view = client->view;
 			wlr_output_layout_get_box(server.output_layout, client->output->wlr, &old_output);
 			client->output = output;
-			client->view = &output->views[output->current_view];
+			attach_client(client, OUTPUT_CURRENT_VIEW(output), client->layer);
+			arrange_view(old_view);
+			release_view_if_unused(old_view);
 			//client->config.x += (old_output.x - output_box.x);
 			//client->config.y += (old_output.y - output_box.y);
 			configure_client(client, client->config.x + (old_output.x - output_box.x),
 							 client->config.y + (old_output.x - output_box.x),
 							 INT32_MAX, INT32_MAX, UINT32_MAX);
 			printf("Move to new output (%d, %d) (%d, %d)\n", output_box.x, output_box.y, client->config.x, client->config.y);
-			if (client->link.next) wl_list_remove(&client->link);
-			wl_list_insert(client->view->layers[client->layer], &client->link);
 		}
         
 		configure_client(client, server.cursor->x - server.interact_grab_x - output_box.x,
@@ -1253,21 +1933,178 @@ static void send_client_close(Client *client) {
 }
 
 
-static bool try_key_bind(uint32_t modifiers, xkb_keysym_t key) {
-	const struct Key_Bind *bind = KEY_BINDS;
-	const struct Key_Bind *bind_end = &KEY_BINDS[ARRAY_LENGTH(KEY_BINDS)];
-	bool found = false;
+/* ================================================================================
+ * Input latency
+ * ================================================================================*/
+static uint32_t get_latency_bucket(uint64_t us) {
+	if (us < 4) return us;
+	uint32_t log = 63 - __builtin_clzll(us);
+	uint32_t bucket = log * 4 + ((us >> (log - 2)) & 3) - 4;
+	return MIN(bucket, LATENCY_BUCKET_COUNT - 1);
+}
+
+// Smallest latency that goes in the bucket
+static uint64_t get_latency_bucket_floor(uint32_t bucket) {
+	if (bucket < 4) return bucket;
+	return (uint64_t)(4 + (bucket + 4) % 4) << ((bucket + 4) / 4 - 2);
+}
+
+static void add_latency_sample(Latency_Histogram *histogram, uint64_t latency_us) {
+	histogram->buckets[get_latency_bucket(latency_us)]++;
+	histogram->count++;
+	histogram->max_us = MAX(histogram->max_us, latency_us);
+}
+
+static void record_latency(Output *output, int stage, uint64_t latency_us) {
+	if (!output) return;
+	add_latency_sample(&output->latency[stage], latency_us);
+}
+
+static void print_latency_histogram(const char *name, const Latency_Histogram *histogram) {
+	static const double percentiles[] = {0.5, 0.9, 0.99};
 	
-	for (; bind < bind_end; ++bind) {
-		if (bind->modifiers == modifiers && bind->key == key) {
-			found = true;
-			bind->function(bind->arg);
+	printf("  %-14s n=%lu", name, (unsigned long)histogram->count);
+	for (int p = 0, bucket = 0, seen = 0; p < ARRAY_LENGTH(percentiles); ++p) {
+		while (seen + histogram->buckets[bucket] < percentiles[p] * histogram->count) {
+			seen += histogram->buckets[bucket++];
 		}
+		printf(" p%g<%.2fms", percentiles[p] * 100, get_latency_bucket_floor(bucket + 1) / 1000.0);
+	}
+	printf(" max=%.2fms\n   ", histogram->max_us / 1000.0);
+	
+	// Bucket counts as "floor_ms:count"
+	for (int bucket = 0; bucket < LATENCY_BUCKET_COUNT; ++bucket) {
+		if (!histogram->buckets[bucket]) continue;
+		printf(" %.3f:%u", get_latency_bucket_floor(bucket) / 1000.0, histogram->buckets[bucket]);
+	}
+	printf("\n");
+}
+
+// Call at the start of every input handler with the event's time
+static void begin_input_latency(uint32_t time_msec) {
+	uint64_t now = get_monotonic_us();
+	// Event times are CLOCK_MONOTONIC milliseconds cut to 32 bits
+	uint32_t age_ms = (uint32_t)(now / 1000) - time_msec;
+	uint64_t input_us = (now / 1000 - age_ms) * 1000;
+	
+	// Virtual devices don't always fill in a real time
+	input_latency.handling_input_us = 0;
+	if ((uint64_t)age_ms * 1000 > LATENCY_SAMPLE_TIMEOUT_US) return;
+	
+	input_latency.handling_input_us = input_us;
+	record_latency(server.focused_output, LATENCY_DISPATCH, now - input_us);
+	
+	if (!input_latency.pending || now - input_latency.input_us > LATENCY_SAMPLE_TIMEOUT_US) {
+		input_latency.pending = true;
+		input_latency.input_us = input_us;
+		input_latency.client_commit_us = 0;
+		input_latency.output = pool_get_handle(server.focused_output);
+	}
+}
+
+static void end_input_latency() {
+	if (!input_latency.handling_input_us) return;
+	record_latency(server.focused_output, LATENCY_HANDLED, get_monotonic_us() - input_latency.handling_input_us);
+	input_latency.handling_input_us = 0;
+}
+
+static void record_client_commit_latency(Client *client) {
+	if (!input_latency.pending || input_latency.client_commit_us || client != server.focused_client) return;
+	input_latency.client_commit_us = get_monotonic_us();
+	input_latency.output = pool_get_handle(client->output);
+	record_latency(client->output, LATENCY_CLIENT_COMMIT, input_latency.client_commit_us - input_latency.input_us);
+}
+
+static void record_output_commit_latency(Output *output) {
+	if (!input_latency.pending || !input_latency.client_commit_us) return;
+	if (pool_resolve(&pools.outputs, input_latency.output) != output) return;
+	record_latency(output, LATENCY_OUTPUT_COMMIT, get_monotonic_us() - input_latency.input_us);
+	input_latency.pending = false;
+}
+
+static int handle_latency_dump_signal(int signal_number, void *data) {
+	static const char *stage_names[NUM_LATENCY_STAGES] = {
+		[LATENCY_DISPATCH] = "dispatch",
+		[LATENCY_HANDLED] = "handled",
+		[LATENCY_CLIENT_COMMIT] = "client commit",
+		[LATENCY_OUTPUT_COMMIT] = "output commit",
+	};
+	Output *output;
+	
+	wl_list_for_each(output, &server.output_list, link) {
+		printf("Latency on %s\n", output->wlr->name);
+		
+		for (int stage = 0; stage < NUM_LATENCY_STAGES; ++stage) {
+			if (!output->latency[stage].count) continue;
+			print_latency_histogram(stage_names[stage], &output->latency[stage]);
+		}
+		if (output->frame_dispatch.count) print_latency_histogram("frame dispatch", &output->frame_dispatch);
+	}
+	
+	fflush(stdout);
+	return 0;
+}
+
+/* ================================================================================
+ * Binds
+ *
+ * KEY_BINDS and BUTTON_BINDS are compiled at startup into one open-addressed
+ * table keyed on (mode, modifiers, keysym or button). It's kept at most half
+ * full, so a key that isn't bound usually costs a single probe.
+ * ================================================================================*/
+static void add_bind(uint64_t key, void (*function)(Input_Arg), Input_Arg arg) {
+	uint32_t i = hash_bind_key(key) & binds.mask;
+	
+	// Duplicates go in the same probe sequence and all run, same as the old linear scan
+	while (binds.slots[i].key) i = (i + 1) & binds.mask;
+	binds.slots[i] = (Bind_Slot){.key = key, .function = function, .arg = arg};
+}
+
+static void setup_binds() {
+	uint32_t bind_count = ARRAY_LENGTH(KEY_BINDS) + ARRAY_LENGTH(BUTTON_BINDS);
+	uint32_t capacity = 16;
+	
+	while (capacity < bind_count * 2) capacity *= 2;
+	binds.slots = calloc(capacity, sizeof(*binds.slots));
+	binds.mask = capacity - 1;
+	
+	for (int i = 0; i < ARRAY_LENGTH(KEY_BINDS); ++i) {
+		const struct Key_Bind *bind = &KEY_BINDS[i];
+		if (bind->mode >= ARRAY_LENGTH(BIND_MODES)) {
+			printf("Key bind %d uses mode %u, which isn't in BIND_MODES\n", i, bind->mode);
+			continue;
+		}
+		add_bind(BIND_KEY(bind->mode, bind->modifiers, bind->key), bind->function, bind->arg);
+	}
+	
+	for (int i = 0; i < ARRAY_LENGTH(BUTTON_BINDS); ++i) {
+		const struct Button_Binds *bind = &BUTTON_BINDS[i];
+		add_bind(BIND_KEY(0, bind->modifiers, bind->button) | BIND_BUTTON, bind->function, bind->arg);
+	}
+}
+
+// Runs every bind for the key, or only the first one if run_all is false
+static bool run_binds(uint64_t key, bool run_all) {
+	bool found = false;
+	
+	for (uint32_t i = hash_bind_key(key) & binds.mask; binds.slots[i].key; i = (i + 1) & binds.mask) {
+		if (binds.slots[i].key != key) continue;
+		binds.slots[i].function(binds.slots[i].arg);
+		found = true;
+		if (!run_all) break;
 	}
 	
 	return found;
 }
 
+static bool try_key_bind(uint32_t modifiers, xkb_keysym_t key) {
+	return run_binds(BIND_KEY(binds.mode, modifiers, key), true);
+}
+
+static bool try_button_bind(uint32_t modifiers, uint32_t button) {
+	return run_binds(BIND_KEY(0, modifiers, button) | BIND_BUTTON, false);
+}
+
 #if 0
 static void update_clients() {
 	Client *client;
@@ -1336,10 +2173,11 @@ static void update_focus() {
 }
 
 static void update_visibility() {
-	Client *client;
-	if (wl_list_empty(&server.client_update_list)) return;
-	wl_list_for_each(client, &server.client_update_list, update_link) {
+	pool_for_each(&pools.clients, Client, client) {
 		bool client_is_visible = false;
+		if (!client->mapped || client->type == CLIENT_TYPE_LAYER) continue;
+		if (client->type == CLIENT_TYPE_XDG_TOPLEVEL && client->xdg_surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL) continue;
+		
 		client_is_visible |= client->view == OUTPUT_CURRENT_VIEW(client->output);
 		client_is_visible |= !layer_is_view_layer(client->layer);
 		client_is_visible &= should_render_layer(client->view, client->layer);
@@ -1348,17 +2186,215 @@ static void update_visibility() {
 			client_is_visible &= client->layer >= LAYER_VIEW_FULLSCREEN;
 		}
 		
+		// Only tell clients about changes so that switching views doesn't
+		// configure every window
+		if (client_is_visible == client->visible) continue;
+		client->visible = client_is_visible;
+		if (client->process) {
+			client->process->visible_clients += client_is_visible ? 1 : -1;
+			update_process_priority(client->process);
+		}
+		
+		// Hidden toplevels aren't rendered, so they also stop getting frame
+		// callbacks and throttle themselves. xdg_toplevel.suspended would say
+		// so explicitly but needs xdg-shell v6, i.e. wlroots 0.18.
 		if (client->type == CLIENT_TYPE_XDG_TOPLEVEL) {
 			wlr_xdg_toplevel_set_activated(client->xdg_surface->toplevel, client_is_visible);
 		}
 #if USE_XWAYLAND
 		else if (client->type == CLIENT_TYPE_XWAYLAND) {
-			wlr_xwayland_surface_activate(client->xwayland_surface, client_is_visible);
+			// Keep the flag in sync so configure_client() doesn't undo this
+			if (client_is_visible) client->config.flags &= ~CLIENT_CONFIG_MINIMIZED;
+			else client->config.flags |= CLIENT_CONFIG_MINIMIZED;
+			wlr_xwayland_surface_set_minimized(client->xwayland_surface, !client_is_visible);
 		}
 #endif
 	}
 }
 
+/* ================================================================================
+ * Client priorities
+ *
+ * With CONFIG.client_priorities the process owning the focused toplevel gets
+ * its nice value lowered by focused_client_nice, and processes whose toplevels
+ * are all hidden get it raised by hidden_client_nice. Nice values are per
+ * thread, so every thread still at the process's level is changed. Threads
+ * that picked their own nice value or scheduling policy are left alone.
+ *
+ * Xwayland clients all belong to the Xwayland server, so only xdg toplevels
+ * take part.
+ * ================================================================================*/
+static void set_process_nice(Client_Process *process, int nice, bool reset_on_fork) {
+	char path[32];
+	struct dirent *entry;
+	struct sched_param param = {0};
+	
+	snprintf(path, sizeof(path), "/proc/%d/task", process->pid);
+	DIR *tasks = opendir(path);
+	if (!tasks) return; // Exited
+	
+	while ((entry = readdir(tasks))) {
+		pid_t tid = atoi(entry->d_name);
+		if (tid <= 0) continue;
+		if ((sched_getscheduler(tid) & ~SCHED_RESET_ON_FORK) != SCHED_OTHER) continue;
+		
+		errno = 0;
+		int current = getpriority(PRIO_PROCESS, tid);
+		if (errno || (current != process->nice && current != process->base_nice)) continue;
+		
+		// A boosted thread's children and new threads start at nice 0, so a build
+		// started from the focused terminal doesn't get the boost
+		sched_setscheduler(tid, SCHED_OTHER | (reset_on_fork ? SCHED_RESET_ON_FORK : 0), &param);
+		if (setpriority(PRIO_PROCESS, tid, nice) && !client_priorities.reported_error) {
+			printf("Failed to set nice %d on pid %d: %s\n", nice, tid, strerror(errno));
+			client_priorities.reported_error = true;
+		}
+	}
+	closedir(tasks);
+	process->nice = nice;
+}
+
+static void update_process_priority(Client_Process *process) {
+	enum Client_Priority priority = CLIENT_PRIORITY_NORMAL;
+	int nice = process->base_nice;
+	
+	// A boost only goes as far as the process is allowed to be lowered
+	if (process == client_priorities.focused) {
+		priority = CLIENT_PRIORITY_FOCUSED;
+		nice = MIN(nice, MAX(process->min_nice, nice + CONFIG.focused_client_nice));
+	}
+	// Only demote what can be put back afterwards
+	else if (!process->visible_clients && process->base_nice >= process->min_nice) {
+		priority = CLIENT_PRIORITY_HIDDEN;
+		nice += CONFIG.hidden_client_nice;
+	}
+	if (priority == process->priority) return;
+	
+	process->priority = priority;
+	set_process_nice(process, MAX(-20, MIN(nice, 19)), priority == CLIENT_PRIORITY_FOCUSED);
+}
+
+/*
+ * Lowering a nice value needs CAP_SYS_NICE, or else it's limited by the
+ * target's own RLIMIT_NICE: the lowest allowed value is 20 - rlim_cur.
+ * Raising is always allowed.
+ */
+static int get_process_min_nice(pid_t pid) {
+	struct rlimit limit;
+	if (client_priorities.can_sys_nice) return -20;
+	if (prlimit(pid, RLIMIT_NICE, NULL, &limit)) return 20; // Assume nothing can be lowered
+	if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= 40) return -20;
+	return 20 - (int)limit.rlim_cur;
+}
+
+static void update_focused_process() {
+	Client_Process *old_process = client_priorities.focused;
+	Client_Process *new_process = server.focused_client ? server.focused_client->process : NULL;
+	
+	if (old_process == new_process) return;
+	client_priorities.focused = new_process;
+	if (old_process) update_process_priority(old_process);
+	if (new_process) update_process_priority(new_process);
+}
+
+static void attach_client_process(Client *client) {
+	Client_Process *process = NULL;
+	pid_t pid;
+	
+	if (!client_priorities.enabled || client->process) return;
+	wl_client_get_credentials(wl_resource_get_client(get_client_wlr_surface(client)->resource), &pid, NULL, NULL);
+	if (pid <= 0 || pid == getpid()) return;
+	
+	pool_for_each(&pools.client_processes, Client_Process, existing) {
+		if (existing->pid == pid) process = existing;
+	}
+	if (!process) {
+		errno = 0;
+		int nice = getpriority(PRIO_PROCESS, pid);
+		if (errno) return;
+		
+		process = pool_alloc(&pools.client_processes);
+		process->pid = pid;
+		process->base_nice = nice;
+		process->nice = nice;
+		process->min_nice = get_process_min_nice(pid);
+	}
+	
+	process->client_count++;
+	process->visible_clients += client->visible;
+	client->process = process;
+	update_process_priority(process);
+}
+
+static void detach_client_process(Client *client) {
+	Client_Process *process = client->process;
+	if (!process) return;
+	
+	client->process = NULL;
+	process->client_count--;
+	process->visible_clients -= client->visible;
+	if (process->client_count) {
+		update_process_priority(process);
+		return;
+	}
+	
+	if (client_priorities.focused == process) client_priorities.focused = NULL;
+	if (process->priority != CLIENT_PRIORITY_NORMAL) set_process_nice(process, process->base_nice, false);
+	pool_free(&pools.client_processes, process);
+}
+
+static void setup_client_priorities() {
+	if (!CONFIG.client_priorities) return;
+	
+	// CapEff is a hex mask, CAP_SYS_NICE is bit 23
+	char line[256];
+	FILE *status = fopen("/proc/self/status", "re");
+	while (status && fgets(line, sizeof(line), status)) {
+		if (!strncmp(line, "CapEff:", 7)) {
+			client_priorities.can_sys_nice = (strtoull(&line[7], NULL, 16) >> 23) & 1;
+			break;
+		}
+	}
+	if (status) fclose(status);
+	
+	if (!client_priorities.can_sys_nice) {
+		printf("No CAP_SYS_NICE, client priorities are limited by each client's RLIMIT_NICE\n");
+	}
+	client_priorities.enabled = true;
+}
+
+/* ================================================================================
+ * Main loop scheduling
+ *
+ * With CONFIG.main_loop_priority the main thread runs SCHED_RR, so input and
+ * frames don't wait behind whatever else wants the CPU. The kernel's RT
+ * throttling still leaves other tasks 5% if we ever spin. Without
+ * CAP_SYS_NICE or RLIMIT_RTPRIO it falls back to main_loop_nice, and without
+ * RLIMIT_NICE either it stays as it was.
+ *
+ * SCHED_RESET_ON_FORK keeps this to the main thread. Threads started after
+ * this (wlroots' and ours) and launched programs run SCHED_OTHER at nice 0.
+ * Font workers start earlier and never had it.
+ * ================================================================================*/
+static void setup_main_loop_scheduling() {
+	struct sched_param param = {.sched_priority = CONFIG.main_loop_priority};
+	if (!CONFIG.main_loop_priority) return;
+	
+	if (!sched_setscheduler(0, SCHED_RR | SCHED_RESET_ON_FORK, &param)) {
+		printf("Main loop scheduling: SCHED_RR priority %d\n", CONFIG.main_loop_priority);
+		return;
+	}
+	printf("Can't use SCHED_RR for the main loop: %s\n", strerror(errno));
+	
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER | SCHED_RESET_ON_FORK, &param);
+	if (!setpriority(PRIO_PROCESS, 0, CONFIG.main_loop_nice)) {
+		printf("Main loop scheduling: nice %d\n", CONFIG.main_loop_nice);
+		return;
+	}
+	printf("Can't raise the main loop's priority either: %s\n", strerror(errno));
+}
+
 /* ================================================================================
  * Output management protocol
  * ================================================================================*/
@@ -1399,6 +2435,11 @@ static void output_manager_test_or_apply(struct wlr_output_configuration_v1 *con
 		}
 	}
     
+	if (apply) {
+		Output *output;
+		wl_list_for_each(output, &server.output_list, link) arrange_output(output);
+		damage_all_outputs();
+	}
 	update_output_configuration();
 	wlr_output_configuration_v1_send_succeeded(config);
 }
@@ -1424,6 +2465,8 @@ static void handle_toplevel_request_fullscreen(struct wl_listener *listener, voi
         wlr_output_effective_resolution(output->wlr, &width, &height);
 		configure_client(client, 0, 0, width, height, 
                          CLIENT_CONFIG_FULLSCREEN * (client->xdg_surface->toplevel->requested.fullscreen == true));
+		// The request needs a reply even when configure_client() had nothing to send
+		wlr_xdg_surface_schedule_configure(client->xdg_surface);
 	}
 	else {
 		client->requesting_fullscreen = 1;
@@ -1432,7 +2475,7 @@ static void handle_toplevel_request_fullscreen(struct wl_listener *listener, voi
 
 static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
 	struct wlr_xdg_surface *xdg_surface = data;
-	Client *client = calloc(1, sizeof(Client));
+	Client *client = pool_alloc(&pools.clients);
 	
 	client->type = CLIENT_TYPE_XDG_TOPLEVEL;
 	client->xdg_surface = xdg_surface;
@@ -1443,6 +2486,7 @@ static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
 	
 	if (xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
 		listen(&client->on_request_fullscreen, &handle_toplevel_request_fullscreen, &xdg_surface->toplevel->events.request_fullscreen);
+		listen(&client->on_set_title, &handle_set_title, &xdg_surface->toplevel->events.set_title);
 	}
 	
 }
@@ -1452,7 +2496,7 @@ static void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
  * ================================================================================*/
 static void handle_new_layer_surface(struct wl_listener *listener, void *data) {
 	struct wlr_layer_surface_v1 *layer_surface = data;
-	Client *client = calloc(1, sizeof(Client));
+	Client *client = pool_alloc(&pools.clients);
 	
 	client->type = CLIENT_TYPE_LAYER;
 	client->layer_surface = layer_surface;
@@ -1569,44 +2613,112 @@ static void handle_xwayland_request_fullscreen(struct wl_listener *listener, voi
 
 static void handle_new_xwayland_surface(struct wl_listener *listener, void *data) {
 	struct wlr_xwayland_surface *surface = data;
-	Client *client = calloc(1, sizeof(Client));
+	Client *client = pool_alloc(&pools.clients);
 	
 	client->type = CLIENT_TYPE_XWAYLAND;
 	client->xwayland_surface = surface;
 	
+	listen(&client->on_destroy, &handle_destroy_surface, &surface->events.destroy);
 	listen(&client->on_map, &handle_map_surface, &surface->events.map);
 	listen(&client->on_unmap, &handle_unmap_surface, &surface->events.unmap);
 	listen(&client->on_request_configure, &handle_xwayland_request_configure, &surface->events.request_configure);
 	listen(&client->on_request_fullscreen, &handle_xwayland_request_fullscreen, &surface->events.request_fullscreen);
 	listen(&client->on_request_minimize, &handle_xwayland_request_minimize, &surface->events.request_minimize);
+	listen(&client->on_set_title, &handle_set_title, &surface->events.set_title);
 }
 
 #endif
 /* ================================================================================
  * Pointer contraints
  * ================================================================================*/
+/*
+ * Only the focused surface's constraint is active. Motion is clipped against
+ * constraint->region, which wlroots keeps as the intersection of the requested
+ * region and the surface's input region in surface coordinates.
+ */
+static bool get_constraint_surface_origin(struct wlr_pointer_constraint_v1 *constraint, double *x, double *y) {
+	Client *client = server.focused_client;
+	if (!client || get_client_wlr_surface(client) != constraint->surface) return false;
+	
+	struct wlr_box output_box;
+	wlr_output_layout_get_box(server.output_layout, client->output->wlr, &output_box);
+	*x = client->config.x + output_box.x;
+	*y = client->config.y + output_box.y;
+	return true;
+}
+
+// Pull the cursor back inside a confine region it's not in, e.g. after the region shrank
+static void warp_into_pointer_constraint(struct wlr_pointer_constraint_v1 *constraint) {
+	double origin_x, origin_y;
+	if (constraint->type != WLR_POINTER_CONSTRAINT_V1_CONFINED) return;
+	if (!get_constraint_surface_origin(constraint, &origin_x, &origin_y)) return;
+	
+	double sx = server.cursor->x - origin_x;
+	double sy = server.cursor->y - origin_y;
+	if (pixman_region32_contains_point(&constraint->region, floor(sx), floor(sy), NULL)) return;
+	
+	int rect_count;
+	pixman_box32_t *rects = pixman_region32_rectangles(&constraint->region, &rect_count);
+	if (rect_count == 0) return;
+	
+	// Nearest point of the nearest rectangle
+	double best_x = 0, best_y = 0, best_distance = INFINITY;
+	for (int i = 0; i < rect_count; ++i) {
+		double x = fmin(fmax(sx, rects[i].x1), rects[i].x2 - 1);
+		double y = fmin(fmax(sy, rects[i].y1), rects[i].y2 - 1);
+		double distance = (x - sx) * (x - sx) + (y - sy) * (y - sy);
+		if (distance < best_distance) {
+			best_distance = distance;
+			best_x = x;
+			best_y = y;
+		}
+	}
+	wlr_cursor_warp_closest(server.cursor, NULL, origin_x + best_x, origin_y + best_y);
+	wlr_seat_pointer_notify_motion(server.seat, get_monotonic_us() / 1000, best_x, best_y);
+}
+
+static void activate_pointer_constraint(struct wlr_pointer_constraint_v1 *constraint) {
+	if (constraint == server.active_constraint) return;
+	
+	if (server.active_constraint) {
+		wlr_pointer_constraint_v1_send_deactivated(server.active_constraint);
+	}
+	server.active_constraint = constraint;
+	if (constraint) {
+		wlr_pointer_constraint_v1_send_activated(constraint);
+		warp_into_pointer_constraint(constraint);
+	}
+}
+
 static void handle_pointer_constraint_destroy(struct wl_listener *listener, void *data) {
 	Pointer_Constraint *constraint = wl_container_of(listener, constraint, on_destroy);
-	free(constraint);
+	if (server.active_constraint == constraint->constraint) {
+		// Already being destroyed, so there's no one to send deactivated to
+		server.active_constraint = NULL;
+	}
+	wl_list_remove(&constraint->on_set_region.link);
+	wl_list_remove(&constraint->on_destroy.link);
+	pool_free(&pools.pointer_constraints, constraint);
 }
 
-// @TODO
-#if 0
-static void handle_pointer_constraint_set_region(struct wl_listener *listener, void *data) {	
+static void handle_pointer_constraint_set_region(struct wl_listener *listener, void *data) {
+	Pointer_Constraint *constraint = wl_container_of(listener, constraint, on_set_region);
+	if (server.active_constraint == constraint->constraint) {
+		warp_into_pointer_constraint(constraint->constraint);
+	}
 }
-#endif
 
 static void handle_new_pointer_constraint(struct wl_listener *listener, void *data) {
 	struct wlr_pointer_constraint_v1 *constraint = data;
-	Pointer_Constraint *server_constraint = calloc(1, sizeof(Pointer_Constraint));
+	Pointer_Constraint *server_constraint = pool_alloc(&pools.pointer_constraints);
 	server_constraint->constraint = constraint;
-	/*listen(&server_constraint->on_set_region, &handle_pointer_constraint_set_region, 
-		   &constraint->events.set_region);*/
+	listen(&server_constraint->on_set_region, &handle_pointer_constraint_set_region, 
+		   &constraint->events.set_region);
 	listen(&server_constraint->on_destroy, &handle_pointer_constraint_destroy, 
 		   &constraint->events.destroy);
 	
 	if (server.focused_client && (get_client_wlr_surface(server.focused_client) == constraint->surface)) {
-		wlr_pointer_constraint_v1_send_activated(constraint);
+		activate_pointer_constraint(constraint);
 	}
 	
 	printf("New pointer constraint:\n"
@@ -1637,21 +2749,41 @@ static void handle_seat_request_set_selection(struct wl_listener *listener, void
  * Keyboard handling
  * ================================================================================*/
 static void handle_keyboard_key(struct wl_listener *listener, void *data) {
-	prevent_idle();
-	
 	struct wlr_keyboard_key_event *event = data;
 	Keyboard *keyboard = wl_container_of(listener, keyboard, on_key);
 	
+	record_input(event->time_msec, (Input_Record){.type = INPUT_RECORD_KEY, .state = event->state, .code = event->keycode});
+	begin_input_latency(event->time_msec);
+	process_keyboard_key(keyboard, event);
+	end_input_latency();
+}
+
+static void process_keyboard_key(Keyboard *keyboard, struct wlr_keyboard_key_event *event) {
+	prevent_idle();
+	
 	wlr_seat_set_keyboard(server.seat, keyboard->wlr);
 	
 	if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->wlr);
 		uint32_t xkeycode = event->keycode + 8;
+		uint32_t mode = binds.mode;
+		bool is_modifier = false;
 		const xkb_keysym_t *keysyms;
 		uint32_t keysym_count = xkb_state_key_get_syms(keyboard->wlr->xkb_state, xkeycode, &keysyms);
 		
 		for (uint32_t i = 0; i < keysym_count; ++i) {
-			if (try_key_bind(modifiers, keysyms[i])) return;
+			if (try_key_bind(modifiers, keysyms[i])) {
+				// Chords end after one key, unless the bind moved to another mode
+				if (BIND_MODES[mode].one_shot && binds.mode == mode) set_bind_mode(0);
+				return;
+			}
+			is_modifier |= keysyms[i] >= XKB_KEY_Shift_L && keysyms[i] <= XKB_KEY_Hyper_R;
+		}
+		
+		// An unbound key cancels a chord and doesn't reach the client
+		if (BIND_MODES[mode].one_shot && !is_modifier) {
+			set_bind_mode(0);
+			return;
 		}
 	}
 	
@@ -1666,6 +2798,34 @@ static void handle_keyboard_modifiers(struct wl_listener *listener, void *data)
 	wlr_seat_keyboard_notify_modifiers(server.seat, &keyboard->wlr->modifiers);
 }
 
+static void handle_keyboard_destroy(struct wl_listener *listener, void *data) {
+	Keyboard *keyboard = wl_container_of(listener, keyboard, on_destroy);
+	
+	wl_list_remove(&keyboard->on_key.link);
+	wl_list_remove(&keyboard->on_modifiers.link);
+	wl_list_remove(&keyboard->on_destroy.link);
+	if (wlr_seat_get_keyboard(server.seat) == keyboard->wlr) {
+		wlr_seat_set_keyboard(server.seat, &server.keyboard_group->keyboard);
+	}
+	pool_free(&pools.keyboards, keyboard);
+}
+
+static void setup_keyboards() {
+	struct xkb_context *xkb = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	server.keymap = xkb_keymap_new_from_names(xkb, NULL, 0);
+	xkb_context_unref(xkb);
+	
+	server.keyboard_group = wlr_keyboard_group_create();
+	wlr_keyboard_set_keymap(&server.keyboard_group->keyboard, server.keymap);
+	wlr_keyboard_set_repeat_info(&server.keyboard_group->keyboard, 25, 500);
+	
+	Keyboard *keyboard = pool_alloc(&pools.keyboards);
+	keyboard->wlr = &server.keyboard_group->keyboard;
+	listen(&keyboard->on_key, &handle_keyboard_key, &keyboard->wlr->events.key);
+	listen(&keyboard->on_modifiers, &handle_keyboard_modifiers, &keyboard->wlr->events.modifiers);
+	wlr_seat_set_keyboard(server.seat, keyboard->wlr);
+}
+
 /* ================================================================================
  * Cursor handling
  * ================================================================================*/
@@ -1673,29 +2833,36 @@ static void handle_cursor_axis(struct wl_listener *listener, void *data) {
 	prevent_idle();
 	
 	struct wlr_pointer_axis_event *event = data;
+	record_input(event->time_msec, (Input_Record){
+		.type = INPUT_RECORD_AXIS, .state = event->orientation, .source = event->source,
+		.code = event->delta_discrete, .values = {event->delta},
+	});
+	begin_input_latency(event->time_msec);
 	wlr_seat_pointer_notify_axis(server.seat, event->time_msec, event->orientation, 
 								 event->delta, event->delta_discrete, event->source);
+	end_input_latency();
 }
 
 static void handle_cursor_button(struct wl_listener *listener, void *data) {
-	prevent_idle();
-	
 	struct wlr_pointer_button_event *event = data;
 	
+	record_input(event->time_msec, (Input_Record){.type = INPUT_RECORD_BUTTON, .state = event->state, .code = event->button});
+	begin_input_latency(event->time_msec);
+	process_cursor_button(event);
+	end_input_latency();
+}
+
+static void process_cursor_button(struct wlr_pointer_button_event *event) {
+	prevent_idle();
+	
 	if (event->state && server.focus_mode == FOCUS_MODE_ON_CLICK) {
 		update_focus();
 	}
 	
 	if (event->state) {
 		struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(server.seat);
-		if (keyboard) {
-			uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard);
-			for (int i = 0; i < ARRAY_LENGTH(BUTTON_BINDS); ++i) {
-				if (BUTTON_BINDS[i].modifiers == modifiers && BUTTON_BINDS[i].button == event->button) {
-					BUTTON_BINDS[i].function(BUTTON_BINDS[i].arg);
-					return;
-				}
-			}
+		if (keyboard && try_button_bind(wlr_keyboard_get_modifiers(keyboard), event->button)) {
+			return;
 		}
 	}
 	else {
@@ -1706,26 +2873,51 @@ static void handle_cursor_button(struct wl_listener *listener, void *data) {
 }
 
 static void handle_cursor_frame(struct wl_listener *listener, void *data) {
+	record_input(0, (Input_Record){.type = INPUT_RECORD_FRAME});
 	wlr_seat_pointer_notify_frame(server.seat);
 }
 
 static void handle_cursor_motion(struct wl_listener *listener, void *data) {
+	struct wlr_pointer_motion_event *event = data;
+	
+	record_input(event->time_msec, (Input_Record){
+		.type = INPUT_RECORD_MOTION, 
+		.values = {event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy},
+	});
+	begin_input_latency(event->time_msec);
+	process_cursor_motion(event);
+	end_input_latency();
+}
+
+static void process_cursor_motion(struct wlr_pointer_motion_event *event) {
 	if (CONFIG.cursor_movement_prevents_idle) prevent_idle();
 	
-	struct wlr_pointer_motion_event *event = data;
-	Client *client = server.focused_client;
+	// Relative motion is unclipped, that's what locked and confined clients read
+	wlr_relative_pointer_manager_v1_send_relative_motion(server.relative_pointer_manager,
+														 server.seat, (uint64_t)event->time_msec * 1000,
+														 event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy);
 	
-	// Check for pointer constraint and apply
-	if (client) {
-		struct wlr_surface *wlr_surface = get_client_wlr_surface(client);
-		struct wlr_pointer_constraint_v1 *constraint = 
-			wlr_pointer_constraints_v1_constraint_for_surface(server.pointer_constraints, wlr_surface, server.seat);
-		if (constraint && constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) {
-			wlr_relative_pointer_manager_v1_send_relative_motion(server.relative_pointer_manager,
-																 server.seat, (uint64_t)event->time_msec * 1000,
-																 event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy);
+	struct wlr_pointer_constraint_v1 *constraint = server.active_constraint;
+	double origin_x, origin_y;
+	if (constraint && server.cursor_mode == CURSOR_MODE_NORMAL && 
+		get_constraint_surface_origin(constraint, &origin_x, &origin_y)) {
+		if (constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) return;
+		
+		/*
+		 * The pointer can't leave the focused surface, so skip the hit test and
+		 * focus update in process_cursor_move and send the motion straight to it
+		 */
+		double sx = server.cursor->x - origin_x;
+		double sy = server.cursor->y - origin_y;
+		double confined_x, confined_y;
+		if (!wlr_region_confine(&constraint->region, sx, sy, sx + event->delta_x, sy + event->delta_y, 
+								&confined_x, &confined_y)) {
 			return;
 		}
+		wlr_cursor_move(server.cursor, &event->pointer->base, confined_x - sx, confined_y - sy);
+		wlr_seat_pointer_notify_motion(server.seat, event->time_msec, 
+									   server.cursor->x - origin_x, server.cursor->y - origin_y);
+		return;
 	}
     
 	wlr_cursor_move(server.cursor, &event->pointer->base, event->delta_x, event->delta_y);
@@ -1734,8 +2926,11 @@ static void handle_cursor_motion(struct wl_listener *listener, void *data) {
 
 static void handle_cursor_motion_absolute(struct wl_listener *listener, void *data) {
 	struct wlr_pointer_motion_absolute_event *event = data;
+	record_input(event->time_msec, (Input_Record){.type = INPUT_RECORD_MOTION_ABSOLUTE, .values = {event->x, event->y}});
+	begin_input_latency(event->time_msec);
 	wlr_cursor_warp_absolute(server.cursor, &event->pointer->base, event->x, event->y);
 	process_cursor_move(event->time_msec);
+	end_input_latency();
 }
 
 /* ================================================================================
@@ -1744,21 +2939,117 @@ static void handle_cursor_motion_absolute(struct wl_listener *listener, void *da
 
 static void handle_output_destroy(struct wl_listener *listener, void *data) {
 	Output *output = wl_container_of(listener, output, on_destroy);
-	free(output);
+	wl_list_remove(&output->link);
+	wl_list_remove(&output->on_frame.link);
+	wl_list_remove(&output->on_present.link);
+	wl_list_remove(&output->on_destroy.link);
+	if (server.focused_output == output) {
+		server.focused_output = wl_list_empty(&server.output_list) ? NULL :
+			wl_container_of(server.output_list.next, server.focused_output, link);
+	}
+	
+	// Nothing may point into the views below once they're freed
+	Output *fallback = server.focused_output;
+	pool_for_each(&pools.clients, Client, client) {
+		if (client->output != output) continue;
+		
+		if (!client->mapped) {
+			client->output = NULL;
+			client->view = NULL;
+		}
+		// Layer surfaces are bound to the output, so they're closed with it
+		else if (client->type == CLIENT_TYPE_LAYER) {
+			wlr_layer_surface_v1_destroy(client->layer_surface);
+		}
+		// Keep the view index, so that clients stay grouped as they were
+		else if (fallback) {
+			client->output = fallback;
+			attach_client(client, get_output_view(fallback, client->view->index), client->layer);
+		}
+		// Unmapped until handle_new_output maps it again
+		else {
+			handle_unmap_surface(&client->on_unmap, NULL);
+			client->output = NULL;
+			client->view = NULL;
+			client->awaiting_output = 1;
+		}
+	}
+	if (fallback) {
+		arrange_output(fallback);
+		update_visibility();
+	}
+	
+	for (int i = 0; i < NUM_OUTPUT_LAYERS; ++i) {
+		client_table_finish(&output->output_tables[i]);
+	}
+	wlr_damage_ring_finish(&output->damage_ring);
+	for (uint32_t i = 0; i < output->view_capacity; ++i) {
+		View *view = output->views[i];
+		if (!view) continue;
+		for (int j = 0; j < NUM_VIEW_LAYERS; ++j) 
+			client_table_finish(&view->view_tables[j]);
+		pool_free(&pools.views, view);
+	}
+	free(output->views);
+	pool_free(&pools.outputs, output);
+	
+	// Others may have been showing floating clients from it
+	damage_all_outputs();
+}
+
+static void handle_output_present(struct wl_listener *listener, void *data) {
+	Output *output = wl_container_of(listener, output, on_present);
+	struct wlr_output_event_present *event = data;
+	
+	// Backends we run on present with CLOCK_MONOTONIC
+	if (!event->presented || !event->when) return;
+	output->present_us = event->when->tv_sec * 1000000ull + event->when->tv_nsec / 1000;
+}
+
+// The headless frame timer is re-armed for 1000000 / refresh ms once the frame handler returns
+static void update_headless_frame_deadline(Output *output) {
+	if (wlr_output_is_headless(output->wlr) && output->wlr->refresh > 0) {
+		output->frame_deadline_us = get_monotonic_us() + 1000000 / output->wlr->refresh * 1000ull;
+	}
 }
 
 static void handle_output_frame(struct wl_listener *listener, void *data) {
 	Output *output = wl_container_of(listener, output, on_frame);
-	View *view = &output->views[output->current_view];
+	View *view = OUTPUT_CURRENT_VIEW(output);
 	float clear_color[4] = {0, 0, 0, 1};
+	pixman_region32_t damage;
+	int buffer_age;
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
-    
+	
+	// How long the main loop took to get to us after the page flip. Headless
+	// outputs present inside the commit and send frames from a timer, so there
+	// it's measured from when that timer was due instead.
+	uint64_t due_us = wlr_output_is_headless(output->wlr) ? output->frame_deadline_us : output->present_us;
+	if (due_us) {
+		uint64_t now_us = now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+		if (now_us - due_us < LATENCY_SAMPLE_TIMEOUT_US) {
+			add_latency_sample(&output->frame_dispatch, now_us - due_us);
+		}
+		output->present_us = 0;
+	}
+	
+	// Nothing changed, so leave the screen as it is and let frames stop
+	wlr_damage_ring_set_bounds(&output->damage_ring, output->wlr->width, output->wlr->height);
+	if (!pixman_region32_not_empty(&output->damage_ring.current)) {
+		update_headless_frame_deadline(output);
+		return;
+	}
+	if (!wlr_output_attach_render(output->wlr, &buffer_age)) return;
+	
+	// Everything is still drawn, but clipped to what this buffer is missing
+	pixman_region32_init(&damage);
+	wlr_damage_ring_get_buffer_damage(&output->damage_ring, buffer_age, &damage);
 	{
-		int width, height;
-		wlr_output_attach_render(output->wlr, NULL);
-		wlr_output_effective_resolution(output->wlr, &width, &height);
+		pixman_box32_t *extents = pixman_region32_extents(&damage);
+		struct wlr_box scissor = {extents->x1, extents->y1, extents->x2 - extents->x1, extents->y2 - extents->y1};
 		wlr_renderer_begin(server.renderer, output->wlr->width, output->wlr->height);
+		wlr_renderer_scissor(server.renderer, &scissor);
 		wlr_renderer_clear(server.renderer, clear_color);
 	}
 	
@@ -1766,7 +3057,7 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 	if (wl_list_empty(view->layers[LAYER_VIEW_FULLSCREEN])) {
 		for (int layer = 0; layer <= LAYER_VIEW_FLOATING; ++layer) {
 			if (should_render_layer(view, layer)) {
-				render_client_list(view->layers[layer], output, 0, 0, &now);
+				render_client_table(view->tables[layer], output, 0, 0, &now);
 			}
 		}
 	}
@@ -1808,7 +3099,7 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 		wl_list_for_each(other_output, &server.output_list, link) {
 			if (other_output == output) continue;
 			View *other_view;
-			other_view = &other_output->views[other_output->current_view];
+			other_view = OUTPUT_CURRENT_VIEW(other_output);
 			wlr_output_layout_get_box(server.output_layout, other_output->wlr, &other_output_box);
 			
 			double x_offset = other_output_box.x - this_output_box.x;
@@ -1816,7 +3107,7 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 			
 			for (int layer = LAYER_VIEW_FLOATING; layer <= LAYER_OUTPUT_OVERLAY; ++layer) {
 				if (should_render_layer(other_view, layer) && layer != LAYER_VIEW_FULLSCREEN) {
-					render_client_list(other_view->layers[layer], output, x_offset, y_offset, &now);
+					render_client_table(other_view->tables[layer], output, x_offset, y_offset, &now);
 				}
 			}
 		}
@@ -1824,7 +3115,7 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 	
 	for (int layer = LAYER_OUTPUT_STICKY; layer <= LAYER_OUTPUT_POPUPS; ++layer) {
 		if (should_render_layer(view, layer)) {
-			render_client_list(view->layers[layer], output, 0, 0, &now);
+			render_client_table(view->tables[layer], output, 0, 0, &now);
 		}
 	}
 	
@@ -1834,12 +3125,25 @@ static void handle_output_frame(struct wl_listener *listener, void *data) {
 	
 	for (int layer = LAYER_OUTPUT_TOP; layer < NUM_LAYERS; ++layer) {
 		if (should_render_layer(view, layer)) {
-			render_client_list(view->layers[layer], output, 0, 0, &now);
+			render_client_table(view->tables[layer], output, 0, 0, &now);
 		}
 	}
 	
+	wlr_renderer_scissor(server.renderer, NULL);
 	wlr_renderer_end(server.renderer);
-	wlr_output_commit(output->wlr);
+	wlr_output_set_damage(output->wlr, &damage);
+	pixman_region32_fini(&damage);
+	// Keep the damage if the commit failed so the next frame tries again
+	if (wlr_output_commit(output->wlr)) wlr_damage_ring_rotate(&output->damage_ring);
+	record_output_commit_latency(output);
+	record_replay_frame(&now);
+	update_headless_frame_deadline(output);
+	
+	static bool first_frame = true;
+	if (first_frame) {
+		printf("First frame after %.1fms\n", get_milliseconds_since(&server.start_time));
+		first_frame = false;
+	}
 }
 
 /* ================================================================================
@@ -1852,19 +3156,18 @@ static void handle_new_input(struct wl_listener *listener, void *data) {
 	printf("Connecting input device %s\n", device->name);
 	
 	if (device->type == WLR_INPUT_DEVICE_KEYBOARD) {
-		Keyboard *keyboard = calloc(1, sizeof(Keyboard));
-		keyboard->wlr = wlr_keyboard_from_input_device(device);
-		struct xkb_context *xkb = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-		struct xkb_keymap *keymap = xkb_keymap_new_from_names(xkb, NULL, 0);
-		wlr_keyboard_set_keymap(keyboard->wlr, keymap);
-		xkb_keymap_unref(keymap);
-		xkb_context_unref(xkb);
+		struct wlr_keyboard *wlr_keyboard = wlr_keyboard_from_input_device(device);
+		wlr_keyboard_set_keymap(wlr_keyboard, server.keymap);
+		wlr_keyboard_set_repeat_info(wlr_keyboard, 25, 500);
 		
-		wlr_seat_set_keyboard(server.seat, keyboard->wlr);
-		wlr_keyboard_set_repeat_info(keyboard->wlr, 25, 500);
-		
-		listen(&keyboard->on_key, &handle_keyboard_key, &keyboard->wlr->events.key);
-		listen(&keyboard->on_modifiers, &handle_keyboard_modifiers, &keyboard->wlr->events.modifiers);
+		if (!wlr_keyboard_group_add_keyboard(server.keyboard_group, wlr_keyboard)) {
+			printf("%s doesn't match the keyboard group, using it on its own\n", device->name);
+			Keyboard *keyboard = pool_alloc(&pools.keyboards);
+			keyboard->wlr = wlr_keyboard;
+			listen(&keyboard->on_key, &handle_keyboard_key, &wlr_keyboard->events.key);
+			listen(&keyboard->on_modifiers, &handle_keyboard_modifiers, &wlr_keyboard->events.modifiers);
+			listen(&keyboard->on_destroy, &handle_keyboard_destroy, &device->events.destroy);
+		}
 		
 		seat_caps |= WL_SEAT_CAPABILITY_KEYBOARD;
 	} else if (device->type == WLR_INPUT_DEVICE_POINTER) {
@@ -1905,7 +3208,7 @@ void update_output_configuration() {
 
 static void handle_new_output(struct wl_listener *listener, void *data) {
 	struct wlr_output *wlr_output = data;
-	Output *new_output = calloc(1, sizeof(Output));
+	Output *new_output = pool_alloc(&pools.outputs);
 	
 	printf("Configuring output %s\n", wlr_output->name);
 	
@@ -1913,30 +3216,17 @@ static void handle_new_output(struct wl_listener *listener, void *data) {
 	new_output->bar_height = CONFIG.bar_height;
 	wlr_output->data = new_output;
 	wlr_output_init_render(wlr_output, server.allocator, server.renderer);
+	wlr_damage_ring_init(&new_output->damage_ring);
 	
 	// Initialize layers
 	for (int i = 0; i < NUM_OUTPUT_LAYERS; ++i) {
 		wl_list_init(&new_output->output_layers[i]);
 	}
+
 	
-	// Initialize views
-	for (int i = 0; i < 9; ++i) {
-		View *view = &new_output->views[i];
-		view->layer_show_mask = UINT32_MAX;
-		view->layout = LAYOUT_DEFAULT;
-		for (int j = 0; j < NUM_VIEW_LAYERS; ++j)
-			wl_list_init(&view->view_layers[j]);
-		
-		view->layers[LAYER_OUTPUT_BACKGROUND] = &new_output->output_layers[OUTPUT_LAYER_BACKGROUND];
-		view->layers[LAYER_OUTPUT_BOTTOM] = &new_output->output_layers[OUTPUT_LAYER_BOTTOM];
-		view->layers[LAYER_VIEW_TILES] = &view->view_layers[VIEW_LAYER_TILES];
-		view->layers[LAYER_VIEW_FLOATING] = &view->view_layers[VIEW_LAYER_FLOATING];
-		view->layers[LAYER_VIEW_FULLSCREEN] = &view->view_layers[VIEW_LAYER_FULLSCREEN];
-		view->layers[LAYER_OUTPUT_POPUPS] = &new_output->output_layers[OUTPUT_LAYER_POPUPS];
-		view->layers[LAYER_OUTPUT_STICKY] = &new_output->output_layers[OUTPUT_LAYER_STICKY];
-		view->layers[LAYER_OUTPUT_TOP] = &new_output->output_layers[OUTPUT_LAYER_TOP];
-		view->layers[LAYER_OUTPUT_OVERLAY] = &new_output->output_layers[OUTPUT_LAYER_OVERLAY];
-	}
+	// Only the current view exists up front, the rest are made on demand
+	new_output->layer_show_mask = UINT32_MAX;
+	get_output_view(new_output, 0);
 	
 	
 	// Apply configuration and commit
@@ -1985,8 +3275,12 @@ static void handle_new_output(struct wl_listener *listener, void *data) {
 			}
 		}
 		
-		if (!found_config) wlr_output_set_mode(new_output->wlr, wlr_output_preferred_mode(new_output->wlr));
+		// Headless outputs have no modes, only the size they were made with
+		if (!found_config && !wl_list_empty(&new_output->wlr->modes)) {
+			wlr_output_set_mode(new_output->wlr, wlr_output_preferred_mode(new_output->wlr));
+		}
 		
+		wlr_output_enable(new_output->wlr, true);
 		wlr_output_commit(new_output->wlr);
 	}
     
@@ -1994,20 +3288,49 @@ static void handle_new_output(struct wl_listener *listener, void *data) {
 	wlr_output_layout_add_auto(server.output_layout, wlr_output);
 	listen(&new_output->on_destroy, &handle_output_destroy, &wlr_output->events.destroy);
 	listen(&new_output->on_frame, &handle_output_frame, &wlr_output->events.frame);
+	listen(&new_output->on_present, &handle_output_present, &wlr_output->events.present);
 	wl_list_insert(&server.output_list, &new_output->link);
+	damage_all_outputs();
 	
 	if (!server.focused_output) server.focused_output = new_output;
 	
+	// Map the surfaces that came in while there were no outputs
+	pool_for_each(&pools.clients, Client, client) {
+		if (!client->awaiting_output) continue;
+		client->awaiting_output = 0;
+		handle_map_surface(&client->on_map, NULL);
+	}
+	
 	// Update configuration for wlr_output_manager_v1
 	update_output_configuration();
 }
 
 int main(int argc, char **argv) {
+	clock_gettime(CLOCK_MONOTONIC, &server.start_time);
 	wlr_log_init(WLR_ERROR, NULL);
 	wl_list_init(&server.output_list);
-	wl_list_init(&server.client_update_list);
+	
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--record") && i + 1 < argc && !input_trace.replaying) {
+			if (!start_input_recording(argv[++i])) return 1;
+		}
+		else if (!strcmp(argv[i], "--replay") && i + 1 < argc && !input_trace.recording) {
+			if (!load_input_trace(argv[++i])) return 1;
+		}
+		else if (!strcmp(argv[i], "--cpu-load")) {
+			input_trace.cpu_load = true;
+		}
+		else if (!strcmp(argv[i], "--benchmark-tables")) {
+			run_table_benchmark();
+			return 0;
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--record trace | --replay trace] [--cpu-load] [--benchmark-tables]\n", argv[0]);
+			return 1;
+		}
+	}
     
-	log_file = fopen("log.dump", "w");
+	log_file = fopen("log.dump", "we");
 	
 	server.display = wl_display_create();
 	server.output_layout = wlr_output_layout_create();
@@ -2015,13 +3338,20 @@ int main(int argc, char **argv) {
 	server.xdg_decoration_manager = wlr_xdg_decoration_manager_v1_create(server.display);
 	server.xdg_output_manager = wlr_xdg_output_manager_v1_create(server.display, server.output_layout);
 	
-	server.backend = wlr_backend_autocreate(server.display);
+	// Replays run on one headless output, so they don't need a GPU or any input devices
+	if (input_trace.replaying) {
+		server.backend = wlr_headless_backend_create(server.display);
+	}
+	else {
+		server.backend = wlr_backend_autocreate(server.display);
+	}
 	listen(&server.on_new_input, &handle_new_input, &server.backend->events.new_input);
 	listen(&server.on_new_output, &handle_new_output, &server.backend->events.new_output);
 	
 	server.seat = wlr_seat_create(server.display, "seat0");
 	listen(&server.on_request_set_cursor, &handle_seat_request_set_cursor, &server.seat->events.request_set_cursor);
 	listen(&server.on_request_set_selection, &handle_seat_request_set_selection, &server.seat->events.request_set_selection);
+	setup_keyboards();
 	
 	server.xdg_shell = wlr_xdg_shell_create(server.display, 3);
 	listen(&server.on_new_xdg_surface, &handle_new_xdg_surface, &server.xdg_shell->events.new_surface);
@@ -2067,6 +3397,7 @@ int main(int argc, char **argv) {
 #endif
 	server.allocator = wlr_allocator_autocreate(server.backend, server.renderer);
 	server.compositor = wlr_compositor_create(server.display, server.renderer);
+	listen(&server.on_new_surface, &handle_new_surface, &server.compositor->events.new_surface);
 	
 #if USE_XWAYLAND
 	server.xwayland = wlr_xwayland_create(server.display, server.compositor, false);
@@ -2084,22 +3415,36 @@ int main(int argc, char **argv) {
 	wlr_single_pixel_buffer_manager_v1_create(server.display);
 	wlr_idle_inhibit_v1_create(server.display);
 	
-	setup_font_rendering();
 	for (int i = 0; i < ARRAY_LENGTH(FONTS); ++i) {
-		load_font(FONTS[i].path, FONTS[i].px_size);
+		add_font(FONTS[i].path, FONTS[i].px_size);
+	}
+	setup_font_rendering();
+	if (font_workers.event_fd >= 0) {
+		wl_event_loop_add_fd(wl_display_get_event_loop(server.display), font_workers.event_fd, WL_EVENT_READABLE, &handle_glyphs_rasterized, NULL);
 	}
 	
 	const char *socket = wl_display_add_socket_auto(server.display);
 	printf("WAYLAND_DISPLAY=%s\n", socket);
+	printf("Socket ready after %.1fms\n", get_milliseconds_since(&server.start_time));
 	setenv("WAYLAND_DISPLAY", socket, 1);
 	
-	pthread_mutex_init(&status_bar.lock, NULL);
-	pthread_create(&status_bar.update_thread, NULL, &status_update_thread, NULL);
+	setup_status_blocks();
+	setup_binds();
+	setup_client_priorities();
+	setup_main_loop_scheduling();
+	wl_event_loop_add_signal(wl_display_get_event_loop(server.display), SIGUSR1, &handle_latency_dump_signal, NULL);
+	wl_event_loop_add_signal(wl_display_get_event_loop(server.display), SIGCHLD, &handle_child_signal, NULL);
 	
+	if (input_trace.replaying) {
+		wlr_headless_add_output(server.backend, INPUT_TRACE_OUTPUT_WIDTH, INPUT_TRACE_OUTPUT_HEIGHT);
+	}
 	wlr_backend_start(server.backend);
+	start_cpu_load();
+	start_input_replay();
 	wl_display_run(server.display);
 	wl_display_destroy_clients(server.display);
 	wl_display_destroy(server.display);
+	finish_input_trace();
 	fclose(log_file);
     
 	return 0;
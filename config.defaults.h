@@ -26,26 +26,38 @@ static const struct {
 	int cursor_movement_prevents_idle;
 	float bar_background_color[4];
 	float bar_selection_color[4]; /*Color of highlight for the currently selected view*/
-	int status_update_interval_seconds;
+	float bar_text_color[4];
 	int status_separator_thickness; /*Thickness of the bar between status blocks*/
 	int status_padding; /*Padding between status blocks*/
 	float status_separator_color[4]; /*Color of the bar between status blocks*/
 	int border_pixels;
 	float active_border_color[4];
 	float inactive_border_color[4];
+	int view_count; /*Number of views per output. 0 for no limit*/
+	int client_priorities; /*Change client nice values based on focus. Needs CAP_SYS_NICE or RLIMIT_NICE*/
+	int focused_client_nice; /*Added to the nice value of the focused client*/
+	int hidden_client_nice; /*Added to the nice value of clients with nothing on screen*/
+	int main_loop_priority; /*SCHED_RR priority (1-99) for the main loop. 0 to leave it alone. Needs CAP_SYS_NICE or RLIMIT_RTPRIO*/
+	int main_loop_nice; /*Nice value for the main loop when SCHED_RR isn't allowed*/
 } CONFIG = {
 	.gap_size = 4,
 	.bar_height = 20,
 	.cursor_movement_prevents_idle = 0,
 	.bar_background_color = {0.1, 0.1, 0.1, 1},
 	.bar_selection_color = {0.1, 0.1, 0.9, 1},
-	.status_update_interval_seconds = 1,
+	.bar_text_color = {1, 1, 1, 1},
 	.status_separator_thickness = 1,
 	.status_padding = 4,
 	.status_separator_color = {0.3, 0.3, 0.3, 1},
 	.border_pixels = 1,
 	.active_border_color = {0.1, 0.1, 0.9, 1},
 	.inactive_border_color = {0.1, 0.1, 0.3, 1},
+	.view_count = 9,
+	.client_priorities = 0,
+	.focused_client_nice = -5,
+	.hidden_client_nice = 10,
+	.main_loop_priority = 0,
+	.main_loop_nice = -10,
 };
 
 /**
@@ -81,6 +93,20 @@ static const struct {
 
 #define MOD_KEY WLR_MODIFIER_LOGO
 
+/**
+ * Key bind modes. Binds only work in their own mode, and enter_mode() switches
+ * between them. The first mode is the default one, and its name isn't shown
+ * on the bar. A one_shot mode goes back to the default after the next key
+ * press, which is how chords like MOD+x then f are made.
+ */
+static const struct Bind_Mode {
+	const char *name;
+	bool one_shot;
+} BIND_MODES[] = {
+	{"default"},
+	//{"launch", .one_shot = true},
+};
+
 /**
  * Look at functions.h for a list of input functions and layouts.
  */ 
@@ -89,8 +115,13 @@ static const struct Key_Bind {
 	xkb_keysym_t key;
 	void (*function)(Input_Arg arg);
 	Input_Arg arg;
+	uint32_t mode; /*Index into BIND_MODES*/
 } KEY_BINDS[] = {
-	// modifiers, key, function, arg}
+	// modifiers, key, function, arg, mode}
+	
+	// Chord example, needs the launch mode above
+	//{MOD_KEY, XKB_KEY_x, enter_mode, ARG_NUMBER(1)},
+	//{0, XKB_KEY_f, spawn, ARG_COMMAND("firefox"), 1},
 	
 	{MOD_KEY|WLR_MODIFIER_SHIFT, XKB_KEY_Escape, close_server, NO_ARG},
 	{MOD_KEY, XKB_KEY_Return, spawn, ARG_COMMAND("foot")},
@@ -141,16 +172,29 @@ static const struct Button_Binds {
 
 
 /**
- * Status blocks. See functions.h for a list of block functions
+ * Status blocks, drawn from right to left. Each block runs on its own interval
+ * and a slow block doesn't hold up the others. See Status_Block in functions.h.
+ * For example, `pkill -RTMIN+1 capra` refreshes the blocks with .signal = 1.
+ * Native blocks (.function) cost microseconds, commands cost a process spawn
+ * per update. Streaming blocks cost nothing between updates, prefer them for
+ * commands that can print a line whenever something changes. Native blocks with
+ * a .watch only update when the kernel reports a change.
  */ 
-static Status_Function *STATUS_BLOCKS[] = {
-	status_date_and_time,
-	status_memory_usage,
+static const Status_Block STATUS_BLOCKS[] = {
+	{.function = status_date_and_time, .interval_seconds = 1},
+	{.function = status_memory_usage, .interval_seconds = 5},
+	{.function = status_cpu_load, .interval_seconds = 2},
+	//{.function = status_network, .interval_seconds = 2},
+	//{.function = status_battery, .watch = status_watch_power_supply},
+	//{.function = status_backlight, .watch = status_watch_backlight},
+	//{.function = status_network_link, .watch = status_watch_network_link},
+	//{.command = "xkb-switch -W", .stream = true},
+	//{.function = status_mpd}, // Build with ENABLE_MPD_STATUS, see build.sh
 };
 
 /**
- * First font takes priority. Fonts loaded after will only load characters that
- * aren't covered by the previous font.
+ * First font takes priority. Fonts after it are fallbacks for characters the
+ * fonts before them don't cover, and are only opened once such a character is drawn.
  */
 static const struct {
 	char *path;
@@ -16,143 +16,769 @@
 #include <libdrm/drm_fourcc.h>
 #include <freetype/freetype.h>
 #include <wlr/render/drm_format_set.h>
-#include <wchar.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MAX_CHAR_CODES 16384
+#define UNICODE_CODEPOINT_COUNT 0x110000
+#define GLYPH_PAGE_SIZE 256
+#define GLYPH_PAGE_COUNT (UNICODE_CODEPOINT_COUNT / GLYPH_PAGE_SIZE)
+#define TEXT_RUN_CACHE_SIZE 32
+#define FONT_WORKER_MAX 4
+#define GLYPH_CACHE_VERSION 1
+#define GLYPH_CACHE_SAVE_DELAY_MS 5000
+
+enum {
+	GLYPH_LOADED = 1,
+	GLYPH_PENDING = 2, // Queued for a worker, drawn as nothing until uploaded
+};
 
 typedef struct {
 	struct wlr_texture *texture;
-	int8_t x_offset, y_offset, advance, width, height;
-	int8_t padding_[3];
+	int16_t x_offset, y_offset, advance;
+	uint8_t flags;
+	uint8_t padding_;
 } Glyph;
 
+typedef struct {
+	const char *path;
+	int px_size;
+	atomic_bool failure_reported;
+} Font_Face;
+
+/*
+ * Glyphs are loaded the first time they're drawn, from the first face that
+ * has them. The table is two levels so that only pages of codepoints that
+ * have been used get allocated. The faces are fixed once workers start.
+ */
 static struct {
-	// Index is the glyph unicode value
-	Glyph glyphs[MAX_CHAR_CODES];
+	Glyph *pages[GLYPH_PAGE_COUNT];
+	Font_Face *faces; // In priority order
+	int face_count;
+	uint32_t generation; // Bumped when glyphs are added, invalidates text runs
+	uint32_t *conversion_buffer; // Upload staging for expand_coverage()
+	size_t conversion_buffer_size;
 } bar_font;
 
-static FT_Library freetype;
+typedef struct {
+	struct wlr_texture *texture;
+	int16_t x, y; // Relative to the start of the run on the baseline
+} Glyph_Quad;
 
-static void setup_font_rendering() {
-	FT_Init_FreeType(&freetype);
-}
-
-static size_t get_string_glyphs(const char *utf8_string, Glyph *glyphs, size_t *string_length);
-static void load_font(const char *path, int px_size);
-static size_t render_glyphs(float *matrix, Glyph *glyphs, int count, int x, int y);
-
-static size_t get_string_glyphs(const char *string, Glyph *glyphs, size_t *string_length) {
-	size_t ret = 0;
-	size_t length = 0;
-	mbstate_t mbstate;
-	wchar_t unicode;
-    
-	for (; *string; ++glyphs, ++length) {
-		size_t s = mbrtowc(&unicode, string, sizeof(wchar_t), &mbstate);
-		if (s == 0 || s == (size_t)-2 || s == (size_t)-1) break;
-		if (unicode >= MAX_CHAR_CODES) *glyphs = bar_font.glyphs[' '];
-		else *glyphs = bar_font.glyphs[unicode];
-		ret += glyphs->advance;
-		string += s;
-	}
-    
-	if (string_length) *string_length = length;
-	return ret;
-}
-
-static void load_font(const char *path, int px_size) {
-	FT_Face face;
-    
-	if (FT_New_Face(freetype, path, 0, &face)) {
-		printf("Failed to load font \"%s\"\n", path);
-		return;
+/*
+ * A decoded string, ready to draw. Glyphs without a texture (spaces) only
+ * contribute to the advance.
+ */
+typedef struct {
+	uint64_t hash;
+	uint32_t font_generation;
+	uint32_t last_used;
+	char *string;
+	size_t string_length;
+	Glyph_Quad *quads;
+	uint32_t quad_count;
+	uint32_t quad_capacity;
+	uint32_t glyph_count;
+	int advance;
+} Text_Run;
+
+// Least recently used run gets reshaped on a miss
+static Text_Run text_run_cache[TEXT_RUN_CACHE_SIZE];
+
+// Coverage rasterized by a worker, waiting to be uploaded on the main thread
+typedef struct {
+	uint32_t codepoint;
+	int16_t x_offset, y_offset, advance;
+	uint16_t width, height;
+	uint8_t *coverage; // width * height bytes, NULL for spaces
+} Glyph_Bitmap;
+
+// FreeType objects can't be shared between threads, so each worker opens its own
+typedef struct {
+	FT_Library library;
+	FT_Face *faces; // Parallel to bar_font.faces, opened on first use
+	bool *failed;
+} Font_Worker;
+
+/*
+ * Rasterization runs on worker threads so that startup and the first frames
+ * never wait on FreeType. Finished bitmaps are uploaded in batches when the
+ * main loop sees event_fd become readable.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	uint32_t *requests;
+	uint32_t request_head, request_count, request_capacity;
+	Glyph_Bitmap *results;
+	uint32_t result_count, result_capacity;
+	int event_fd;
+	int worker_count;
+	Font_Worker workers[FONT_WORKER_MAX];
+	Font_Worker main_thread_worker; // Used if no worker threads could be started
+} font_workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.event_fd = -1,
+};
+
+/*
+ * Rasterized glyphs are kept in $XDG_CACHE_HOME/capra/glyphs, which is mapped
+ * at startup so that glyphs drawn in earlier sessions never touch FreeType.
+ * The key covers everything that changes the bitmaps: every font's path,
+ * mtime, size and px_size, and the FreeType version. A cache with a different
+ * key or a bad checksum is ignored and rewritten.
+ *
+ * Layout: Glyph_Cache_Header, entry_count entries sorted by codepoint, then
+ * the coverage bytes the entries point into.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_count;
+	uint64_t key;
+	uint64_t data_size;
+	uint64_t checksum; // FNV-1a of everything after the header
+} Glyph_Cache_Header;
+
+typedef struct {
+	uint32_t codepoint;
+	uint32_t data_offset;
+	int16_t x_offset, y_offset, advance;
+	uint16_t width, height;
+	uint16_t padding_;
+} Glyph_Cache_Entry;
+
+static struct {
+	char path[PATH_MAX];
+	uint64_t key;
+	uint8_t *map;
+	size_t map_size;
+	const Glyph_Cache_Entry *entries;
+	uint32_t entry_count;
+	const uint8_t *data;
+	// Rasterized this session and not written yet, owns the coverage
+	Glyph_Bitmap *unsaved;
+	uint32_t unsaved_count, unsaved_capacity;
+	struct wl_event_source *save_timer;
+} glyph_cache;
+
+static void add_font(const char *path, int px_size);
+static void setup_font_rendering();
+static FT_Face get_worker_face(Font_Worker *worker, int index);
+static void rasterize_glyph(Font_Worker *worker, Glyph_Bitmap *bitmap);
+static void *font_worker_main(void *data);
+static const Glyph *get_glyph(uint32_t codepoint);
+static void request_glyph(Glyph *glyph, uint32_t codepoint);
+static void expand_coverage(uint32_t *pixels, const uint8_t *coverage, int count, const float *color);
+static void upload_glyph(const Glyph_Bitmap *bitmap);
+static bool upload_rasterized_glyphs();
+static void setup_glyph_cache();
+static void load_glyph_cache();
+static const Glyph_Cache_Entry *find_cached_glyph(uint32_t codepoint);
+static void add_unsaved_glyph(Glyph_Bitmap *bitmap);
+static int save_glyph_cache(void *data);
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size);
+static uint64_t hash_string(const char *string, size_t *length);
+static uint32_t decode_utf8(const char **string);
+static void shape_text_run(Text_Run *run, const char *string, size_t length, uint64_t hash);
+static const Text_Run *get_text_run(const char *string);
+static int render_text_run(float *matrix, const Text_Run *run, int x, int y);
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+
+// FNV-1a, chain calls by passing the previous result
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001b3;
 	}
-	else if (FT_Select_Charmap(face, FT_ENCODING_UNICODE)) {
-		printf("%s is not a unicode font\n", path);
-		return;
+	return hash;
+}
+
+// FNV-1a
+static uint64_t hash_string(const char *string, size_t *length) {
+	uint64_t hash = FNV_OFFSET_BASIS;
+	const char *c;
+	
+	for (c = string; *c; ++c) {
+		hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
 	}
-    
-	printf("Loading font %s\n", path);
-    
-	FT_Set_Pixel_Sizes(face, px_size, 0);
-    
-	struct {
-		uint8_t *memory;
-		size_t size;
-	} conversion_buffer = {NULL, 0};
-	
-	// Copy the glyphs to wlr_texture objects
-	// @TODO: Figure out a way to store glyphs in a texture atlas because this
-	// is very memory-inefficient
-	for (uint16_t char_code = 0; char_code < MAX_CHAR_CODES; ++char_code) {
-		uint32_t glyph_index = FT_Get_Char_Index(face, char_code);
-		Glyph *glyph = &bar_font.glyphs[char_code];
-        
-		if (glyph->texture || glyph->advance) continue;
-		if (!glyph_index) continue;
-		
-		int width, height, pixel_count, output_pixel_data_size;
-		uint8_t *input_buffer;
-        
-		FT_Load_Glyph(face, glyph_index, 0);
-		FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL);
+	
+	*length = c - string;
+	return hash;
+}
+
+/*
+ * Titles and status text are UTF-8 whatever the locale is, so this decodes it
+ * directly rather than through mbrtowc. Malformed sequences, overlongs and
+ * surrogates become U+FFFD and skip one byte.
+ */
+static uint32_t decode_utf8(const char **string) {
+	static const uint32_t min_codepoint[] = {0, 0, 0x80, 0x800, 0x10000};
+	const uint8_t *c = (const uint8_t*)*string;
+	uint32_t codepoint = 0;
+	int length = 0;
+	
+	if (c[0] < 0x80) {
+		*string += 1;
+		return c[0];
+	}
+	else if ((c[0] & 0xe0) == 0xc0) { codepoint = c[0] & 0x1f; length = 2; }
+	else if ((c[0] & 0xf0) == 0xe0) { codepoint = c[0] & 0x0f; length = 3; }
+	else if ((c[0] & 0xf8) == 0xf0) { codepoint = c[0] & 0x07; length = 4; }
+	
+	// Stops at the terminator too, since it isn't a continuation byte
+	bool valid = length > 0;
+	for (int i = 1; valid && i < length; ++i) {
+		valid = (c[i] & 0xc0) == 0x80;
+		codepoint = (codepoint << 6) | (c[i] & 0x3f);
+	}
+	valid = valid && codepoint >= min_codepoint[length] && codepoint < UNICODE_CODEPOINT_COUNT &&
+		(codepoint < 0xd800 || codepoint > 0xdfff);
+	
+	*string += valid ? length : 1;
+	return valid ? codepoint : 0xfffd;
+}
+
+static void shape_text_run(Text_Run *run, const char *string, size_t length, uint64_t hash) {
+	int x = 0;
+	
+	run->string = realloc(run->string, length + 1);
+	memcpy(run->string, string, length + 1);
+	run->string_length = length;
+	run->hash = hash;
+	run->quad_count = 0;
+	run->glyph_count = 0;
+	
+	for (const char *c = string; *c; ) {
+		const Glyph *glyph = get_glyph(decode_utf8(&c));
 		
-		width = face->glyph->bitmap.width;
-		height = face->glyph->bitmap.rows;
-		pixel_count = width*height;
-		output_pixel_data_size = pixel_count * 4;
-        
-		glyph->x_offset = face->glyph->metrics.horiBearingX >> 6;
-		glyph->y_offset = face->glyph->metrics.horiBearingY >> 6;
-		glyph->advance = face->glyph->metrics.horiAdvance >> 6;
-		glyph->width = width;
-		glyph->height = height;
-        
-		// Check if glyph is a space
-		if (!pixel_count) {
-			continue;
+		if (glyph->texture) {
+			if (run->quad_count == run->quad_capacity) {
+				run->quad_capacity = run->quad_capacity ? run->quad_capacity * 2 : 16;
+				run->quads = realloc(run->quads, run->quad_capacity * sizeof(*run->quads));
+			}
+			run->quads[run->quad_count++] = (Glyph_Quad){
+				.texture = glyph->texture,
+				.x = x + glyph->x_offset,
+				.y = -glyph->y_offset,
+			};
 		}
 		
-		input_buffer = face->glyph->bitmap.buffer;
+		x += glyph->advance;
+		run->glyph_count++;
+	}
+	
+	run->advance = x;
+	// After decoding, since loading new glyphs bumps the generation
+	run->font_generation = bar_font.generation;
+}
+
+// The returned run is only valid until the next call
+static const Text_Run *get_text_run(const char *string) {
+	static uint32_t clock;
+	size_t length;
+	uint64_t hash = hash_string(string, &length);
+	Text_Run *oldest = &text_run_cache[0];
+	
+	clock++;
+	
+	for (int i = 0; i < TEXT_RUN_CACHE_SIZE; ++i) {
+		Text_Run *run = &text_run_cache[i];
+		if (run->string && run->hash == hash && run->string_length == length &&
+			run->font_generation == bar_font.generation && !memcmp(run->string, string, length)) {
+			run->last_used = clock;
+			return run;
+		}
+		if (run->last_used < oldest->last_used) oldest = run;
+	}
+	
+	shape_text_run(oldest, string, length, hash);
+	oldest->last_used = clock;
+	return oldest;
+}
+
+// Must be called before setup_font_rendering()
+static void add_font(const char *path, int px_size) {
+	bar_font.faces = realloc(bar_font.faces, (bar_font.face_count + 1) * sizeof(*bar_font.faces));
+	bar_font.faces[bar_font.face_count] = (Font_Face){.path = path, .px_size = px_size};
+	bar_font.face_count++;
+}
+
+// FreeType itself is only initialized once the worker gets a cache miss
+static void setup_font_worker(Font_Worker *worker) {
+	worker->faces = calloc(bar_font.face_count, sizeof(*worker->faces));
+	worker->failed = calloc(bar_font.face_count, sizeof(*worker->failed));
+}
+
+static void setup_font_rendering() {
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int worker_count = MAX(1, MIN(cpu_count - 1, FONT_WORKER_MAX));
+	
+	setup_glyph_cache();
+	font_workers.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	
+	/*
+	 * Workers start with every signal blocked. The event loop takes signals
+	 * through signalfd, which only sees them if no thread can take them first.
+	 */
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	
+	for (int i = 0; i < worker_count && font_workers.event_fd >= 0; ++i) {
+		pthread_t thread;
+		Font_Worker *worker = &font_workers.workers[font_workers.worker_count];
+		setup_font_worker(worker);
+		if (pthread_create(&thread, NULL, &font_worker_main, worker)) {
+			printf("Failed to start font worker: %s\n", strerror(errno));
+			break;
+		}
+		pthread_detach(thread);
+		font_workers.worker_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	
+	if (!font_workers.worker_count) {
+		printf("No font workers, rasterizing on the main thread\n");
+		setup_font_worker(&font_workers.main_thread_worker);
+	}
+	
+	// Most of the bar is ASCII, so get it going before the first frame asks
+	for (uint32_t c = ' '; c <= '~'; ++c) get_glyph(c);
+}
+
+// Returns NULL if the font couldn't be opened
+static FT_Face get_worker_face(Font_Worker *worker, int index) {
+	Font_Face *font = &bar_font.faces[index];
+	FT_Face *face = &worker->faces[index];
+	const char *error = NULL;
+	
+	if (*face || worker->failed[index]) return *face;
+	if (!worker->library && FT_Init_FreeType(&worker->library)) {
+		worker->library = NULL;
+		return NULL;
+	}
+	
+	if (FT_New_Face(worker->library, font->path, 0, face)) {
+		error = "Failed to load font \"%s\"\n";
+		*face = NULL;
+	}
+	else if (FT_Select_Charmap(*face, FT_ENCODING_UNICODE)) {
+		error = "%s is not a unicode font\n";
+		FT_Done_Face(*face);
+		*face = NULL;
+	}
+	
+	if (error) {
+		worker->failed[index] = true;
+		if (!atomic_exchange(&font->failure_reported, true)) printf(error, font->path);
+		return NULL;
+	}
+	
+	FT_Set_Pixel_Sizes(*face, font->px_size, 0);
+	return *face;
+}
+
+static void rasterize_glyph(Font_Worker *worker, Glyph_Bitmap *bitmap) {
+	FT_Face face = NULL;
+	uint32_t glyph_index = 0;
+	
+	for (int i = 0; i < bar_font.face_count && !glyph_index; ++i) {
+		face = get_worker_face(worker, i);
+		if (face) glyph_index = FT_Get_Char_Index(face, bitmap->codepoint);
+	}
+	
+	// No font has it, use the missing glyph box from the first font
+	if (!glyph_index && bar_font.face_count) face = get_worker_face(worker, 0);
+	if (!face || FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER)) return;
+	
+	FT_GlyphSlot slot = face->glyph;
+	bitmap->x_offset = slot->metrics.horiBearingX >> 6;
+	bitmap->y_offset = slot->metrics.horiBearingY >> 6;
+	bitmap->advance = slot->metrics.horiAdvance >> 6;
+	bitmap->width = slot->bitmap.width;
+	bitmap->height = slot->bitmap.rows;
+	
+	// Check if glyph is a space
+	if (!bitmap->width || !bitmap->height) return;
+	
+	bitmap->coverage = malloc(bitmap->width * bitmap->height);
+	for (int y = 0; y < bitmap->height; ++y) {
+		memcpy(bitmap->coverage + y * bitmap->width, slot->bitmap.buffer + y * slot->bitmap.pitch, bitmap->width);
+	}
+}
+
+static void *font_worker_main(void *data) {
+	Font_Worker *worker = data;
+	
+	for (;;) {
+		Glyph_Bitmap bitmap = {0};
 		
-		if (!conversion_buffer.memory || (conversion_buffer.size < output_pixel_data_size)) {
-			conversion_buffer.memory = realloc(conversion_buffer.memory, output_pixel_data_size);
-			conversion_buffer.size = output_pixel_data_size;
+		pthread_mutex_lock(&font_workers.lock);
+		while (font_workers.request_head == font_workers.request_count) {
+			pthread_cond_wait(&font_workers.wake, &font_workers.lock);
+		}
+		bitmap.codepoint = font_workers.requests[font_workers.request_head++];
+		if (font_workers.request_head == font_workers.request_count) {
+			font_workers.request_head = font_workers.request_count = 0;
 		}
+		pthread_mutex_unlock(&font_workers.lock);
 		
-		// Convert r8 to rgba8888
-		uint8_t *conversion_buffer_iterator = conversion_buffer.memory;
-		for (int i = 0; i < pixel_count; ++i) {
-			conversion_buffer_iterator[0] = input_buffer[0];
-			conversion_buffer_iterator[1] = input_buffer[0];
-			conversion_buffer_iterator[2] = input_buffer[0];
-			conversion_buffer_iterator[3] = input_buffer[0];
-			input_buffer += 1;
-			conversion_buffer_iterator += 4;
+		rasterize_glyph(worker, &bitmap);
+		
+		pthread_mutex_lock(&font_workers.lock);
+		if (font_workers.result_count == font_workers.result_capacity) {
+			font_workers.result_capacity = font_workers.result_capacity ? font_workers.result_capacity * 2 : 64;
+			font_workers.results = realloc(font_workers.results, font_workers.result_capacity * sizeof(*font_workers.results));
 		}
+		font_workers.results[font_workers.result_count++] = bitmap;
+		pthread_mutex_unlock(&font_workers.lock);
 		
-		glyph->texture = 
-			wlr_texture_from_pixels(server.renderer, DRM_FORMAT_ABGR8888, width * 4, 
-                                    width, height, conversion_buffer.memory);
-        
+		// EAGAIN means the counter is saturated, so a wakeup is already pending
+		while (eventfd_write(font_workers.event_fd, 1) && errno != EAGAIN) {
+			if (errno != EINTR) {
+				printf("Failed to wake the main thread for glyphs: %s\n", strerror(errno));
+				break;
+			}
+		}
 	}
-	free(conversion_buffer.memory);
+	
+	return NULL;
 }
 
-static size_t render_glyphs(float *matrix, Glyph *glyphs, int count, int x, int y) {
-	Glyph *glyph = glyphs;
-	size_t ret = 0;
-    
-	for (int i = 0; i < count; ++i, ++glyph) {
-		if (glyph->texture) {
-			wlr_render_texture(server.renderer, glyph->texture, matrix,
-                               x + glyph->x_offset, y - glyph->y_offset, 1.f);
+static const Glyph *get_glyph(uint32_t codepoint) {
+	if (codepoint >= UNICODE_CODEPOINT_COUNT) codepoint = 0xfffd;
+	
+	Glyph **page = &bar_font.pages[codepoint / GLYPH_PAGE_SIZE];
+	if (!*page) *page = calloc(GLYPH_PAGE_SIZE, sizeof(Glyph));
+	
+	Glyph *glyph = &(*page)[codepoint % GLYPH_PAGE_SIZE];
+	if (!(glyph->flags & (GLYPH_LOADED | GLYPH_PENDING))) request_glyph(glyph, codepoint);
+	return glyph;
+}
+
+static void request_glyph(Glyph *glyph, uint32_t codepoint) {
+	const Glyph_Cache_Entry *entry = find_cached_glyph(codepoint);
+	
+	if (entry) {
+		Glyph_Bitmap bitmap = {
+			.codepoint = codepoint,
+			.x_offset = entry->x_offset,
+			.y_offset = entry->y_offset,
+			.advance = entry->advance,
+			.width = entry->width,
+			.height = entry->height,
+			.coverage = (entry->width && entry->height) ? (uint8_t*)glyph_cache.data + entry->data_offset : NULL,
+		};
+		upload_glyph(&bitmap);
+		bar_font.generation++;
+		return;
+	}
+	
+	if (!font_workers.worker_count) {
+		Glyph_Bitmap bitmap = {.codepoint = codepoint};
+		rasterize_glyph(&font_workers.main_thread_worker, &bitmap);
+		upload_glyph(&bitmap);
+		add_unsaved_glyph(&bitmap);
+		bar_font.generation++;
+		return;
+	}
+	
+	glyph->flags |= GLYPH_PENDING;
+	
+	pthread_mutex_lock(&font_workers.lock);
+	if (font_workers.request_count == font_workers.request_capacity) {
+		font_workers.request_capacity = font_workers.request_capacity ? font_workers.request_capacity * 2 : 128;
+		font_workers.requests = realloc(font_workers.requests, font_workers.request_capacity * sizeof(*font_workers.requests));
+	}
+	font_workers.requests[font_workers.request_count++] = codepoint;
+	pthread_cond_signal(&font_workers.wake);
+	pthread_mutex_unlock(&font_workers.lock);
+}
+
+/*
+ * Coverage is single channel everywhere until upload. wlr_renderer can only
+ * sample textures as color with a global alpha, so this is where the text
+ * color gets applied, as premultiplied ABGR8888. Whole pixels at a time with
+ * no branches so that the compiler vectorizes it.
+ */
+static void expand_coverage(uint32_t *pixels, const uint8_t *coverage, int count, const float *color) {
+	// 0 to 256, so that white gives back exactly the coverage
+	uint32_t r = color[0] * color[3] * 256.f + 0.5f;
+	uint32_t g = color[1] * color[3] * 256.f + 0.5f;
+	uint32_t b = color[2] * color[3] * 256.f + 0.5f;
+	uint32_t a = color[3] * 256.f + 0.5f;
+	
+	for (int i = 0; i < count; ++i) {
+		uint32_t c = coverage[i];
+		pixels[i] = ((c * r) >> 8) | (((c * g) >> 8) << 8) | (((c * b) >> 8) << 16) | (((c * a) >> 8) << 24);
+	}
+}
+
+static void upload_glyph(const Glyph_Bitmap *bitmap) {
+	Glyph *glyph = &bar_font.pages[bitmap->codepoint / GLYPH_PAGE_SIZE][bitmap->codepoint % GLYPH_PAGE_SIZE];
+	int pixel_count = bitmap->width * bitmap->height;
+	size_t output_pixel_data_size = pixel_count * 4;
+	
+	glyph->flags = GLYPH_LOADED;
+	glyph->x_offset = bitmap->x_offset;
+	glyph->y_offset = bitmap->y_offset;
+	glyph->advance = bitmap->advance;
+	
+	if (!bitmap->coverage) return;
+	
+	if (bar_font.conversion_buffer_size < output_pixel_data_size) {
+		bar_font.conversion_buffer = realloc(bar_font.conversion_buffer, output_pixel_data_size);
+		bar_font.conversion_buffer_size = output_pixel_data_size;
+	}
+	
+	expand_coverage(bar_font.conversion_buffer, bitmap->coverage, pixel_count, CONFIG.bar_text_color);
+	
+	glyph->texture = 
+		wlr_texture_from_pixels(server.renderer, DRM_FORMAT_ABGR8888, bitmap->width * 4, 
+								bitmap->width, bitmap->height, bar_font.conversion_buffer);
+}
+
+// Call when event_fd is readable. Returns true if any glyphs were uploaded.
+static bool upload_rasterized_glyphs() {
+	eventfd_t count;
+	// Results are taken regardless, EAGAIN just means an earlier call already got them
+	if (eventfd_read(font_workers.event_fd, &count) && errno != EAGAIN) {
+		printf("Failed to read the glyph eventfd: %s\n", strerror(errno));
+	}
+	
+	// Take the whole batch so the workers can keep going during the upload
+	pthread_mutex_lock(&font_workers.lock);
+	Glyph_Bitmap *batch = font_workers.results;
+	uint32_t batch_count = font_workers.result_count;
+	font_workers.results = NULL;
+	font_workers.result_count = font_workers.result_capacity = 0;
+	pthread_mutex_unlock(&font_workers.lock);
+	
+	for (uint32_t i = 0; i < batch_count; ++i) {
+		upload_glyph(&batch[i]);
+		add_unsaved_glyph(&batch[i]);
+	}
+	free(batch);
+	
+	if (batch_count) bar_font.generation++;
+	return batch_count > 0;
+}
+
+static void setup_glyph_cache() {
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char directory[PATH_MAX - sizeof("/glyphs")];
+	
+	if (cache_home && cache_home[0]) snprintf(directory, sizeof(directory), "%s", cache_home);
+	else if (home) snprintf(directory, sizeof(directory), "%s/.cache", home);
+	else return;
+	
+	mkdir(directory, 0700);
+	strncat(directory, "/capra", sizeof(directory) - strlen(directory) - 1);
+	mkdir(directory, 0700);
+	snprintf(glyph_cache.path, sizeof(glyph_cache.path), "%s/glyphs", directory);
+	
+	uint32_t key_version[] = {GLYPH_CACHE_VERSION, FREETYPE_MAJOR, FREETYPE_MINOR, FREETYPE_PATCH};
+	uint64_t key = hash_bytes(FNV_OFFSET_BASIS, key_version, sizeof(key_version));
+	
+	for (int i = 0; i < bar_font.face_count; ++i) {
+		const Font_Face *font = &bar_font.faces[i];
+		struct stat font_stat = {0};
+		stat(font->path, &font_stat);
+		int64_t font_key[] = {font->px_size, font_stat.st_mtim.tv_sec, font_stat.st_mtim.tv_nsec, font_stat.st_size};
+		key = hash_bytes(key, font->path, strlen(font->path) + 1);
+		key = hash_bytes(key, font_key, sizeof(font_key));
+	}
+	
+	glyph_cache.key = key;
+	glyph_cache.save_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.display), &save_glyph_cache, NULL);
+	load_glyph_cache();
+}
+
+static void load_glyph_cache() {
+	struct stat file_stat;
+	const Glyph_Cache_Header *header;
+	const char *problem = NULL;
+	int fd = open(glyph_cache.path, O_RDONLY | O_CLOEXEC);
+	
+	if (fd < 0) return;
+	if (fstat(fd, &file_stat) || file_stat.st_size < sizeof(Glyph_Cache_Header)) {
+		close(fd);
+		return;
+	}
+	
+	glyph_cache.map_size = file_stat.st_size;
+	glyph_cache.map = mmap(NULL, glyph_cache.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (glyph_cache.map == MAP_FAILED) {
+		glyph_cache.map = NULL;
+		return;
+	}
+	
+	header = (const Glyph_Cache_Header*)glyph_cache.map;
+	glyph_cache.entries = (const Glyph_Cache_Entry*)(header + 1);
+	glyph_cache.data = (const uint8_t*)(glyph_cache.entries + header->entry_count);
+	
+	if (memcmp(header->magic, "CAPRAGC", 8) || header->version != GLYPH_CACHE_VERSION) {
+		problem = "has an unknown format";
+	}
+	else if (header->key != glyph_cache.key) {
+		problem = "is stale";
+	}
+	else if (sizeof(*header) + (uint64_t)header->entry_count * sizeof(Glyph_Cache_Entry) + header->data_size != glyph_cache.map_size ||
+			 header->checksum != hash_bytes(FNV_OFFSET_BASIS, header + 1, glyph_cache.map_size - sizeof(*header))) {
+		problem = "is corrupt";
+	}
+	
+	for (uint32_t i = 0; i < header->entry_count && !problem; ++i) {
+		const Glyph_Cache_Entry *entry = &glyph_cache.entries[i];
+		if ((uint64_t)entry->data_offset + entry->width * entry->height > header->data_size ||
+			(i && entry->codepoint <= glyph_cache.entries[i-1].codepoint)) {
+			problem = "is corrupt";
 		}
-        
-		x += glyph->advance;
-		ret += glyph->advance;
 	}
-    
-	return ret;
+	
+	if (problem) {
+		printf("Glyph cache %s %s, rebuilding\n", glyph_cache.path, problem);
+		munmap(glyph_cache.map, glyph_cache.map_size);
+		glyph_cache.map = NULL;
+		glyph_cache.entries = NULL;
+		glyph_cache.data = NULL;
+		return;
+	}
+	
+	glyph_cache.entry_count = header->entry_count;
+}
+
+static const Glyph_Cache_Entry *find_cached_glyph(uint32_t codepoint) {
+	uint32_t low = 0, high = glyph_cache.entry_count;
+	
+	while (low < high) {
+		uint32_t middle = (low + high) / 2;
+		uint32_t middle_codepoint = glyph_cache.entries[middle].codepoint;
+		if (middle_codepoint == codepoint) return &glyph_cache.entries[middle];
+		if (middle_codepoint < codepoint) low = middle + 1;
+		else high = middle;
+	}
+	
+	return NULL;
+}
+
+// Takes ownership of the coverage
+static void add_unsaved_glyph(Glyph_Bitmap *bitmap) {
+	if (!glyph_cache.save_timer) {
+		free(bitmap->coverage);
+		return;
+	}
+	
+	if (glyph_cache.unsaved_count == glyph_cache.unsaved_capacity) {
+		glyph_cache.unsaved_capacity = glyph_cache.unsaved_capacity ? glyph_cache.unsaved_capacity * 2 : 64;
+		glyph_cache.unsaved = realloc(glyph_cache.unsaved, glyph_cache.unsaved_capacity * sizeof(*glyph_cache.unsaved));
+	}
+	glyph_cache.unsaved[glyph_cache.unsaved_count++] = *bitmap;
+	
+	// Wait for the burst of glyphs to settle before writing
+	wl_event_source_timer_update(glyph_cache.save_timer, GLYPH_CACHE_SAVE_DELAY_MS);
+}
+
+static int compare_glyph_bitmaps(const void *a, const void *b) {
+	uint32_t codepoint_a = ((const Glyph_Bitmap*)a)->codepoint;
+	uint32_t codepoint_b = ((const Glyph_Bitmap*)b)->codepoint;
+	return (codepoint_a > codepoint_b) - (codepoint_a < codepoint_b);
+}
+
+// Merges the unsaved glyphs with the mapped cache into a new file and maps that
+static int save_glyph_cache(void *data) {
+	uint32_t mapped_count = glyph_cache.entry_count;
+	uint32_t unsaved_count = glyph_cache.unsaved_count;
+	uint32_t entry_count = mapped_count + unsaved_count;
+	Glyph_Cache_Entry *entries = calloc(entry_count, sizeof(*entries));
+	const uint8_t **coverages = calloc(entry_count, sizeof(*coverages));
+	Glyph_Cache_Header header = {.magic = "CAPRAGC", .version = GLYPH_CACHE_VERSION, .entry_count = entry_count, .key = glyph_cache.key};
+	char temporary_path[PATH_MAX + 8];
+	
+	if (!unsaved_count) {
+		free(entries);
+		free(coverages);
+		return 0;
+	}
+	
+	qsort(glyph_cache.unsaved, unsaved_count, sizeof(*glyph_cache.unsaved), &compare_glyph_bitmaps);
+	
+	// Merge by codepoint. A glyph can't be in both since the mapped cache is checked first.
+	for (uint32_t i = 0, m = 0, u = 0; i < entry_count; ++i) {
+		Glyph_Cache_Entry *entry = &entries[i];
+		if (u == unsaved_count || (m < mapped_count && glyph_cache.entries[m].codepoint < glyph_cache.unsaved[u].codepoint)) {
+			*entry = glyph_cache.entries[m++];
+			coverages[i] = glyph_cache.data + entry->data_offset;
+		}
+		else {
+			const Glyph_Bitmap *bitmap = &glyph_cache.unsaved[u++];
+			coverages[i] = bitmap->coverage;
+			*entry = (Glyph_Cache_Entry){
+				.codepoint = bitmap->codepoint,
+				.x_offset = bitmap->x_offset,
+				.y_offset = bitmap->y_offset,
+				.advance = bitmap->advance,
+				.width = bitmap->width,
+				.height = bitmap->height,
+			};
+		}
+		entry->data_offset = header.data_size;
+		header.data_size += entry->width * entry->height;
+	}
+	
+	header.checksum = hash_bytes(FNV_OFFSET_BASIS, entries, entry_count * sizeof(*entries));
+	for (uint32_t i = 0; i < entry_count; ++i) {
+		header.checksum = hash_bytes(header.checksum, coverages[i], entries[i].width * entries[i].height);
+	}
+	
+	snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", glyph_cache.path);
+	FILE *file = fopen(temporary_path, "wb");
+	bool written = file != NULL;
+	
+	if (file) {
+		written &= fwrite(&header, sizeof(header), 1, file) == 1;
+		written &= fwrite(entries, sizeof(*entries), entry_count, file) == entry_count;
+		for (uint32_t i = 0; i < entry_count && written; ++i) {
+			size_t size = entries[i].width * entries[i].height;
+			if (size) written &= fwrite(coverages[i], 1, size, file) == size;
+		}
+		written &= !fclose(file);
+	}
+	
+	free(entries);
+	free(coverages);
+	
+	if (!written || rename(temporary_path, glyph_cache.path)) {
+		printf("Failed to write glyph cache %s: %s\n", glyph_cache.path, strerror(errno));
+		unlink(temporary_path);
+		return 0;
+	}
+	
+	for (uint32_t i = 0; i < unsaved_count; ++i) free(glyph_cache.unsaved[i].coverage);
+	glyph_cache.unsaved_count = 0;
+	if (glyph_cache.map) munmap(glyph_cache.map, glyph_cache.map_size);
+	glyph_cache.map = NULL;
+	glyph_cache.entry_count = 0;
+	load_glyph_cache();
+	return 0;
 }
 
+// Returns the advance of the run
+static int render_text_run(float *matrix, const Text_Run *run, int x, int y) {
+	for (uint32_t i = 0; i < run->quad_count; ++i) {
+		const Glyph_Quad *quad = &run->quads[i];
+		wlr_render_texture(server.renderer, quad->texture, matrix, x + quad->x, y + quad->y, 1.f);
+	}
+	
+	return run->advance;
+}
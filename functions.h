@@ -22,7 +22,7 @@ typedef struct {
 	double decimal;
 	char *string;
 	char **argv;
-	void (*layout)(Output*);
+	void (*layout)(View*);
 } Input_Arg;
 
 /* ================================================================================
@@ -31,6 +31,7 @@ typedef struct {
 static void close_client(Input_Arg arg);
 static void close_server(Input_Arg arg);
 static void cycle_client_layer(Input_Arg arg); // ARG_LAYERS
+static void enter_mode(Input_Arg arg); // ARG_NUMBER, index into BIND_MODES
 static void increment_view(Input_Arg arg); // ARG_NUMBER
 static void move_client(Input_Arg arg);
 static void move_resize_client(Input_Arg arg);
@@ -42,9 +43,49 @@ static void spawn(Input_Arg arg); // ARG_COMMAND
 static void toggle_fullscreen(Input_Arg arg);
 static void toggle_layer(Input_Arg arg); // ARG_NUMBER
 
+/* ================================================================================
+ * Status blocks
+ * ================================================================================*/
+// Writes the block text into buffer and returns its length
+typedef int Status_Function(char *buffer, int max);
+// Returns a non-blocking fd that becomes readable when a native block should update, or -1
+typedef int Status_Watch_Function();
+
+typedef struct {
+	Status_Function *function; // Native block, runs in-process. Set this or command
+	const char *command; // Run with /bin/sh -c, the first line of output is shown
+	int interval_seconds; // 0 to only run at startup and on signal
+	int timeout_seconds; // Kill the command if it runs for longer than this. 0 for no timeout
+	int signal; // Run again when Capra gets SIGRTMIN+signal. 0 for none
+	// Start the command once and keep it running. Every line it prints replaces
+	// the text, and it is restarted if it exits. Interval and timeout are ignored.
+	bool stream;
+	// Native blocks only. Update when the kernel reports a change instead of
+	// polling. interval_seconds can be 0 or kept as a fallback.
+	Status_Watch_Function *watch;
+} Status_Block;
+
+// Native blocks (status.c)
+static int status_backlight(char *buffer, int max); // Define STATUS_BACKLIGHT_PATH to change the device
+static int status_battery(char *buffer, int max); // Define STATUS_BATTERY_PATH to change the battery
+static int status_cpu_load(char *buffer, int max);
+static int status_date_and_time(char *buffer, int max);
+static int status_disk_usage(char *buffer, int max); // Define STATUS_DISK_PATH to change the filesystem
+static int status_memory_usage(char *buffer, int max);
+static int status_network(char *buffer, int max);
+static int status_network_link(char *buffer, int max);
+#ifdef ENABLE_MPD_STATUS
+static int status_mpd(char *buffer, int max); // Updated by MPD itself, needs no interval or watch
+#endif
+
+// Watches for native blocks (status.c)
+static int status_watch_backlight(); // For status_backlight
+static int status_watch_network_link(); // For status_network_link
+static int status_watch_power_supply(); // For status_battery
+
 /* ================================================================================
  * Layouts
  * ================================================================================*/
-static void layout_recursive(Output *output);
+static void layout_recursive(View *view);
 
 #endif
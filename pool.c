@@ -0,0 +1,135 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Fixed-size object pool. Objects live in contiguous slabs of POOL_SLAB_SIZE
+ * slots and are never moved, so pointers stay valid until pool_free().
+ * Freed slots go onto a free list and get reused before a new slab is allocated.
+ *
+ * Every slot carries a generation counter that is bumped on alloc and on free,
+ * so an odd generation means the slot is live. A Pool_Handle remembers the
+ * generation it was created with, which lets stale references be detected
+ * with pool_resolve() instead of reading freed memory.
+ */
+#define POOL_SLAB_SIZE 64
+#define POOL_INDEX_NONE UINT32_MAX
+
+typedef struct {
+	uint32_t index;
+	uint32_t generation;
+} Pool_Handle;
+
+typedef struct {
+	uint32_t index;
+	uint32_t generation;
+	uint32_t next_free;
+	uint32_t padding_;
+} Pool_Slot;
+
+typedef struct {
+	uint8_t **slabs;
+	size_t stride; // Slot header + object, rounded up to 16 bytes
+	uint32_t slab_count;
+	uint32_t first_free;
+	uint32_t live_count;
+} Pool;
+
+#define POOL_INIT(type) {.stride = (sizeof(Pool_Slot) + sizeof(type) + 15) & ~(size_t)15, .first_free = POOL_INDEX_NONE}
+#define pool_slot_is_live(slot) ((slot)->generation & 1)
+
+static inline Pool_Slot *pool_get_slot(const Pool *pool, uint32_t index) {
+	return (Pool_Slot*)(pool->slabs[index / POOL_SLAB_SIZE] + (index % POOL_SLAB_SIZE) * pool->stride);
+}
+
+static inline Pool_Slot *pool_slot_of(void *object) {
+	return (Pool_Slot*)((uint8_t*)object - sizeof(Pool_Slot));
+}
+
+static inline void *pool_slot_object(Pool_Slot *slot) {
+	return (uint8_t*)slot + sizeof(Pool_Slot);
+}
+
+static void pool_grow(Pool *pool) {
+	uint32_t slab_index = pool->slab_count;
+	uint8_t *slab = calloc(POOL_SLAB_SIZE, pool->stride);
+
+	pool->slabs = realloc(pool->slabs, sizeof(*pool->slabs) * (slab_index + 1));
+	pool->slabs[slab_index] = slab;
+	pool->slab_count++;
+
+	// Push in reverse so that the lowest slot gets handed out first
+	for (int i = POOL_SLAB_SIZE - 1; i >= 0; --i) {
+		Pool_Slot *slot = (Pool_Slot*)(slab + i * pool->stride);
+		slot->index = slab_index * POOL_SLAB_SIZE + i;
+		slot->next_free = pool->first_free;
+		pool->first_free = slot->index;
+	}
+}
+
+// Returns zeroed memory, same as calloc
+static void *pool_alloc(Pool *pool) {
+	if (pool->first_free == POOL_INDEX_NONE) pool_grow(pool);
+
+	Pool_Slot *slot = pool_get_slot(pool, pool->first_free);
+	void *object = pool_slot_object(slot);
+
+	pool->first_free = slot->next_free;
+	pool->live_count++;
+	slot->next_free = POOL_INDEX_NONE;
+	slot->generation++;
+	memset(object, 0, pool->stride - sizeof(Pool_Slot));
+
+	return object;
+}
+
+static void pool_free(Pool *pool, void *object) {
+	if (!object) return;
+	Pool_Slot *slot = pool_slot_of(object);
+	assert(pool_slot_is_live(slot));
+
+	slot->generation++;
+	slot->next_free = pool->first_free;
+	pool->first_free = slot->index;
+	pool->live_count--;
+}
+
+static inline Pool_Handle pool_get_handle(void *object) {
+	if (!object) return (Pool_Handle){POOL_INDEX_NONE, 0};
+	Pool_Slot *slot = pool_slot_of(object);
+	return (Pool_Handle){slot->index, slot->generation};
+}
+
+// Returns NULL if the object the handle refers to has been freed
+static inline void *pool_resolve(const Pool *pool, Pool_Handle handle) {
+	if (handle.index >= pool->slab_count * POOL_SLAB_SIZE) return NULL;
+	Pool_Slot *slot = pool_get_slot(pool, handle.index);
+	if (slot->generation != handle.generation) return NULL;
+	return pool_slot_object(slot);
+}
+
+/*
+ * Iterate over every live object in slab order. Safe to pool_free() the
+ * current object while iterating. Don't break out of the body, it only ends
+ * the inner loop.
+ */
+#define pool_for_each(pool, type, var) \
+	for (uint32_t pool_index_ = 0; pool_index_ < (pool)->slab_count * POOL_SLAB_SIZE; ++pool_index_) \
+		if (!pool_slot_is_live(pool_get_slot((pool), pool_index_))) continue; \
+		else for (type *var = pool_slot_object(pool_get_slot((pool), pool_index_)); var; var = NULL)
@@ -14,6 +14,112 @@
    limitations under the License.
 */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/* ================================================================================
+ * Native blocks
+ *
+ * These run in-process. Files are opened once and re-read with pread, and
+ * parsing works in place on a stack buffer. Where a file has named fields the
+ * offset of each field is remembered, so later reads go straight to it and only
+ * fall back to scanning when the layout changes.
+ * ================================================================================*/
+#ifndef STATUS_BATTERY_PATH
+#define STATUS_BATTERY_PATH "/sys/class/power_supply/BAT0"
+#endif
+
+#ifndef STATUS_DISK_PATH
+#define STATUS_DISK_PATH "/"
+#endif
+
+#ifndef STATUS_BACKLIGHT_PATH
+#define STATUS_BACKLIGHT_PATH "/sys/class/backlight/intel_backlight"
+#endif
+
+typedef struct {
+	const char *name; // Including the trailing ':'
+	int offset; // Where name was last found, -1 if never
+} Status_Field;
+
+// Opens the file on first use, then re-reads it from the start. Returns the length read.
+static int status_read_file(int *fd, const char *path, char *buffer, size_t size) {
+	if (*fd < 0) *fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (*fd < 0) return 0;
+	
+	ssize_t length = pread(*fd, buffer, size - 1, 0);
+	if (length < 0) {
+		close(*fd);
+		*fd = -1;
+		return 0;
+	}
+	
+	buffer[length] = 0;
+	return length;
+}
+
+static uint64_t status_parse_number(const char **string) {
+	const char *c = *string;
+	uint64_t value = 0;
+	while (*c == ' ' || *c == '\t') ++c;
+	for (; *c >= '0' && *c <= '9'; ++c) value = value * 10 + (*c - '0');
+	*string = c;
+	return value;
+}
+
+// Finds "name: value" in buffer, trying the last known offset first
+static uint64_t status_get_field(const char *buffer, int length, Status_Field *field) {
+	size_t name_length = strlen(field->name);
+	const char *value;
+	
+	if (field->offset < 0 || field->offset + name_length > length || 
+		memcmp(&buffer[field->offset], field->name, name_length)) {
+		const char *line = buffer;
+		field->offset = -1;
+		
+		while (line && *line) {
+			if (!strncmp(line, field->name, name_length)) {
+				field->offset = line - buffer;
+				break;
+			}
+			line = strchr(line, '\n');
+			if (line) ++line;
+		}
+		
+		if (field->offset < 0) return 0;
+	}
+	
+	value = &buffer[field->offset + name_length];
+	return status_parse_number(&value);
+}
+
+static uint64_t status_get_time_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Blocks marked unused aren't in the default STATUS_BLOCKS, see config.defaults.h
+
+// Formats a byte count as e.g. 1.2M
+__attribute__((unused)) static int status_format_bytes(char *buffer, int max, double bytes) {
+	const char units[] = "BKMGT";
+	int unit = 0;
+	while (bytes >= 1024 && unit < (int)sizeof(units) - 2) {
+		bytes /= 1024;
+		unit++;
+	}
+	return snprintf(buffer, max, bytes < 10 && unit ? "%.1f%c" : "%.0f%c", bytes, units[unit]);
+}
 
 static int status_date_and_time(char *buffer, int max) {
 	time_t time_value = time(NULL);
@@ -22,81 +128,769 @@ static int status_date_and_time(char *buffer, int max) {
 }
 
 static int status_memory_usage(char *buffer, int max) {
-	FILE *meminfo = fopen("/proc/meminfo", "r");
-	if (!meminfo) return 0;
-	int ret = 0;
-    
-	unsigned long total_memory_kb = 0, used_memory_kb = 0;
-	char line[128];
-    
-	while (fgets(line, sizeof(line), meminfo)) {
-		char *value_string;
-		unsigned long value;
-        
-		value_string = strchr(line, ':');
-		if (!value_string) continue;
-        
-		for (; *value_string; ++value_string) {
-			if (isdigit(*value_string)) break;
-		}
-        
-		value = atoll(value_string);
-        
-		if (strstr(line, "MemTotal") == line) total_memory_kb = value;
-		else if (strstr(line, "MemFree") == line) used_memory_kb += value;
-		else if (strstr(line, "SReclaimable") == line) used_memory_kb += value;
-		else if (strstr(line, "Buffers") == line) used_memory_kb += value;
-		else if (strstr(line, "Cached") == line) used_memory_kb += value;
-	}
-    
-	ret = snprintf(buffer, max, "%.2g/%.2gGB", 
-				   (total_memory_kb - used_memory_kb) / (double)(1<<20),
-				   total_memory_kb / (double)(1<<20));
-    
-	fclose(meminfo);
-	return ret;
+	static int fd = -1;
+	static Status_Field fields[] = {
+		{"MemTotal:", -1}, {"MemFree:", -1}, {"Buffers:", -1}, {"Cached:", -1}, {"SReclaimable:", -1},
+	};
+	char meminfo[2048];
+	int length = status_read_file(&fd, "/proc/meminfo", meminfo, sizeof(meminfo));
+	if (!length) return 0;
+	
+	uint64_t total_memory_kb = status_get_field(meminfo, length, &fields[0]);
+	uint64_t free_memory_kb = 0;
+	for (int i = 1; i < ARRAY_LENGTH(fields); ++i) {
+		free_memory_kb += status_get_field(meminfo, length, &fields[i]);
+	}
+	
+	return snprintf(buffer, max, "%.2g/%.2gGB", 
+					(total_memory_kb - free_memory_kb) / (double)(1<<20),
+					total_memory_kb / (double)(1<<20));
+}
+
+static int status_cpu_load(char *buffer, int max) {
+	static int fd = -1;
+	static uint64_t last_busy, last_total;
+	char stat[256]; // Only the first line is needed
+	
+	if (!status_read_file(&fd, "/proc/stat", stat, sizeof(stat))) return 0;
+	if (memcmp(stat, "cpu ", 4)) return 0;
+	
+	// user nice system idle iowait irq softirq steal
+	const char *c = &stat[4];
+	uint64_t values[8];
+	uint64_t total = 0;
+	for (int i = 0; i < ARRAY_LENGTH(values); ++i) {
+		values[i] = status_parse_number(&c);
+		total += values[i];
+	}
+	uint64_t busy = total - values[3] - values[4];
+	
+	uint64_t total_delta = total - last_total;
+	uint64_t busy_delta = busy - last_busy;
+	last_total = total;
+	last_busy = busy;
+	
+	return snprintf(buffer, max, "CPU %2d%%", total_delta ? (int)(busy_delta * 100 / total_delta) : 0);
+}
+
+// Throughput summed over every interface except loopback
+__attribute__((unused)) static int status_network(char *buffer, int max) {
+	static int fd = -1;
+	static uint64_t last_rx, last_tx, last_time_ms;
+	char dev[4096];
+	uint64_t rx = 0, tx = 0;
+	
+	if (!status_read_file(&fd, "/proc/net/dev", dev, sizeof(dev))) return 0;
+	
+	// Two header lines, then "  name: rx_bytes packets errs drop fifo frame compressed multicast tx_bytes ..."
+	for (const char *line = strchr(dev, '\n'); line && (line = strchr(line + 1, '\n'));) {
+		const char *c = strchr(line, ':');
+		if (!c) break;
+		
+		const char *name = line + 1;
+		while (*name == ' ') ++name;
+		if (!memcmp(name, "lo:", 3)) continue;
+		
+		++c;
+		rx += status_parse_number(&c);
+		for (int i = 0; i < 7; ++i) status_parse_number(&c);
+		tx += status_parse_number(&c);
+	}
+	
+	uint64_t now = status_get_time_ms();
+	double seconds = last_time_ms ? (now - last_time_ms) / 1000.0 : 0;
+	char rx_string[16], tx_string[16];
+	
+	status_format_bytes(rx_string, sizeof(rx_string), seconds > 0 ? (rx - last_rx) / seconds : 0);
+	status_format_bytes(tx_string, sizeof(tx_string), seconds > 0 ? (tx - last_tx) / seconds : 0);
+	last_rx = rx;
+	last_tx = tx;
+	last_time_ms = now;
+	
+	return snprintf(buffer, max, "↓%s ↑%s", rx_string, tx_string);
+}
+
+__attribute__((unused)) static int status_disk_usage(char *buffer, int max) {
+	static int fd = -1;
+	struct statvfs stats;
+	char used_string[16], total_string[16];
+	
+	if (fd < 0) fd = open(STATUS_DISK_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstatvfs(fd, &stats)) return 0;
+	
+	status_format_bytes(used_string, sizeof(used_string), 
+						(double)(stats.f_blocks - stats.f_bfree) * stats.f_frsize);
+	status_format_bytes(total_string, sizeof(total_string), (double)stats.f_blocks * stats.f_frsize);
+	return snprintf(buffer, max, "%s %s/%s", STATUS_DISK_PATH, used_string, total_string);
+}
+
+__attribute__((unused)) static int status_battery(char *buffer, int max) {
+	static int capacity_fd = -1, status_fd = -1;
+	char capacity[8], status[32] = "";
+	
+	if (!status_read_file(&capacity_fd, STATUS_BATTERY_PATH "/capacity", capacity, sizeof(capacity))) return 0;
+	status_read_file(&status_fd, STATUS_BATTERY_PATH "/status", status, sizeof(status));
+	
+	const char *c = capacity;
+	char state = 0;
+	if (!memcmp(status, "Charging", 8)) state = '+';
+	else if (!memcmp(status, "Discharging", 11)) state = '-';
+	
+	return snprintf(buffer, max, "BAT %d%%%c", (int)status_parse_number(&c), state ? state : ' ');
+}
+
+__attribute__((unused)) static int status_backlight(char *buffer, int max) {
+	static int brightness_fd = -1, max_brightness_fd = -1;
+	char brightness[16], max_brightness[16];
+	
+	if (!status_read_file(&brightness_fd, STATUS_BACKLIGHT_PATH "/brightness", brightness, sizeof(brightness))) return 0;
+	if (!status_read_file(&max_brightness_fd, STATUS_BACKLIGHT_PATH "/max_brightness", max_brightness, sizeof(max_brightness))) return 0;
+	
+	const char *c = brightness;
+	uint64_t value = status_parse_number(&c);
+	c = max_brightness;
+	uint64_t max_value = status_parse_number(&c);
+	
+	return snprintf(buffer, max, "LIGHT %d%%", max_value ? (int)(value * 100 / max_value) : 0);
+}
+
+// Shows the interface that has the default route
+__attribute__((unused)) static int status_network_link(char *buffer, int max) {
+	static int fd = -1;
+	char route[2048];
+	
+	if (!status_read_file(&fd, "/proc/net/route", route, sizeof(route))) return 0;
+	
+	// "Iface Destination Gateway ...", the default route has destination 00000000
+	for (char *line = strchr(route, '\n'); line && *++line; line = strchr(line, '\n')) {
+		char *name_end = strchr(line, '\t');
+		if (!name_end || memcmp(name_end + 1, "00000000", 8)) continue;
+		return snprintf(buffer, max, "NET %.*s", (int)(name_end - line), line);
+	}
+	
+	return snprintf(buffer, max, "NET offline");
+}
+
+/*
+ * Watches for push-based native blocks. Each returns a non-blocking fd that
+ * becomes readable when the state behind a block may have changed, or -1.
+ */
+// Kernel uevents. Every subsystem's arrive on the socket, handle_status_block_watch()
+// filters them with status_watch_uevent_subsystem().
+static int status_watch_uevents() {
+	struct sockaddr_nl address = {.nl_family = AF_NETLINK, .nl_groups = 1};
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) return -1;
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Power supplies send these when charge or AC state changes
+__attribute__((unused)) static int status_watch_power_supply() {
+	return status_watch_uevents();
+}
+
+// Sent for sysfs writes and also for hotkey and firmware changes, which
+// writing the brightness file alone wouldn't show
+__attribute__((unused)) static int status_watch_backlight() {
+	return status_watch_uevents();
+}
+
+// Link and address changes through rtnetlink
+__attribute__((unused)) static int status_watch_network_link() {
+	struct sockaddr_nl address = {
+		.nl_family = AF_NETLINK, 
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE,
+	};
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) return -1;
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+
+
+/* ================================================================================
+ * Block runner
+ *
+ * Every block command runs as its own child process with its stdout pipe on
+ * the Wayland event loop, so a slow command only holds up its own block.
+ * Streaming blocks are started once and every line they print replaces the text.
+ * ================================================================================*/
+#define STATUS_STREAM_MIN_RESTART_MS 1000
+#define STATUS_STREAM_MAX_RESTART_MS 60000
+
+typedef struct {
+	pid_t pid; // 0 when not running
+	int fd;
+	int restart_delay_ms; // Streaming blocks only
+	bool discarding_line; // Streaming blocks only. Dropping the rest of an overlong line
+	struct wl_event_source *read_source;
+	struct wl_event_source *interval_timer;
+	struct wl_event_source *timeout_timer;
+	size_t read_length;
+	char read_buffer[STATUS_BLOCK_MAX];
+} Status_Block_State;
+
+static Status_Block_State status_block_states[NUM_STATUS_BLOCKS];
+
+static void status_set_block_text(int index, const char *text, size_t length) {
+	char *out = status_bar.block_buffers[index];
+	size_t i;
+	
+	for (i = 0; (i < length) && (i < STATUS_BLOCK_MAX-1) && text[i] && (text[i] != '\n'); ++i);
+	
+	// Leave unchanged text alone so that nothing needs redrawing
+	if (i == status_bar.block_lengths[index] && !memcmp(out, text, i)) return;
+	
+	memcpy(out, text, i);
+	out[i] = 0;
+	status_bar.block_lengths[index] = i;
+	status_bar.generation++;
+	schedule_status_bar_frames();
+}
+
+// Runs command with /bin/sh with its stdout connected to *out_fd (non-blocking)
+static pid_t status_spawn_command(const char *command, int *out_fd) {
+	char *argv[] = {"/bin/sh", "-c", (char*)command, NULL};
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	int pipe_fds[2];
+	pid_t pid;
+	int error;
+	
+	if (pipe2(pipe_fds, O_CLOEXEC)) return -1;
+	
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+	
+	init_spawn_attributes(&attributes);
+	
+	error = posix_spawn(&pid, argv[0], &actions, &attributes, argv, environ);
+	
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	close(pipe_fds[1]);
+	
+	if (error) {
+		close(pipe_fds[0]);
+		return -1;
+	}
+	
+	fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+	*out_fd = pipe_fds[0];
+	return pid;
+}
+
+static void status_finish_block(int index) {
+	Status_Block_State *state = &status_block_states[index];
+	if (!state->pid) return;
+	
+	wl_event_source_remove(state->read_source);
+	state->read_source = NULL;
+	close(state->fd);
+	wl_event_source_timer_update(state->timeout_timer, 0);
+	
+	// The shell has normally exited by the time its stdout closes
+	if (waitpid(state->pid, NULL, WNOHANG) == 0) {
+		kill(state->pid, SIGKILL);
+		waitpid(state->pid, NULL, 0);
+	}
+	
+	state->pid = 0;
+	state->read_length = 0;
+	state->discarding_line = false;
+}
+
+static int status_read_stream(int index, int fd) {
+	Status_Block_State *state = &status_block_states[index];
+	char *buffer = state->read_buffer;
+	ssize_t count;
+	
+	for (;;) {
+		count = read(fd, &buffer[state->read_length], sizeof(state->read_buffer) - state->read_length);
+		if (count <= 0) break;
+		state->read_length += count;
+		
+		if (state->discarding_line) {
+			char *newline = memchr(buffer, '\n', state->read_length);
+			if (!newline) {
+				state->read_length = 0;
+				continue;
+			}
+			state->read_length -= newline + 1 - buffer;
+			memmove(buffer, newline + 1, state->read_length);
+			state->discarding_line = false;
+		}
+		
+		// Only the last complete line matters
+		size_t line_end = state->read_length;
+		while (line_end && buffer[line_end-1] != '\n') --line_end;
+		
+		if (line_end) {
+			size_t line_start = line_end - 1;
+			while (line_start && buffer[line_start-1] != '\n') --line_start;
+			status_set_block_text(index, &buffer[line_start], line_end - 1 - line_start);
+			state->read_length -= line_end;
+			memmove(buffer, &buffer[line_end], state->read_length);
+			state->restart_delay_ms = STATUS_STREAM_MIN_RESTART_MS;
+		}
+		else if (state->read_length == sizeof(state->read_buffer)) {
+			// Show as much of an overlong line as fits
+			status_set_block_text(index, buffer, state->read_length);
+			state->read_length = 0;
+			state->discarding_line = true;
+		}
+	}
+	
+	if (count < 0 && errno == EAGAIN) return 0;
+	
+	// The command exited, start it again after a delay that grows while it keeps failing
+	printf("Status block \"%s\" exited, restarting in %dms\n", STATUS_BLOCKS[index].command, state->restart_delay_ms);
+	status_finish_block(index);
+	wl_event_source_timer_update(state->interval_timer, state->restart_delay_ms);
+	state->restart_delay_ms = MIN(state->restart_delay_ms * 2, STATUS_STREAM_MAX_RESTART_MS);
+	return 0;
+}
+
+static int handle_status_block_readable(int fd, uint32_t mask, void *data) {
+	int index = (intptr_t)data;
+	Status_Block_State *state = &status_block_states[index];
+	ssize_t count = 0;
+	
+	if (STATUS_BLOCKS[index].stream) return status_read_stream(index, fd);
+	
+	// Keep reading until EOF, but only the first line is kept
+	for (;;) {
+		char discard[256];
+		size_t space = sizeof(state->read_buffer) - state->read_length;
+		
+		if (space) count = read(fd, &state->read_buffer[state->read_length], space);
+		else count = read(fd, discard, sizeof(discard));
+		
+		if (count <= 0) break;
+		if (space) state->read_length += count;
+	}
+	
+	if (count < 0 && errno == EAGAIN) return 0;
+	
+	status_set_block_text(index, state->read_buffer, state->read_length);
+	status_finish_block(index);
+	return 0;
+}
+
+static void status_run_block(int index) {
+	const Status_Block *block = &STATUS_BLOCKS[index];
+	Status_Block_State *state = &status_block_states[index];
+	struct wl_event_loop *event_loop = wl_display_get_event_loop(server.display);
+	
+	if (block->function) {
+		char text[STATUS_BLOCK_MAX];
+		int length = block->function(text, sizeof(text));
+		status_set_block_text(index, text, MAX(MIN(length, (int)sizeof(text) - 1), 0));
+		return;
+	}
+	
+	// Still running from last time
+	if (state->pid) return;
+	
+	state->pid = status_spawn_command(block->command, &state->fd);
+	if (state->pid < 0) {
+		state->pid = 0;
+		if (!block->stream) {
+			printf("Failed to run status block \"%s\"\n", block->command);
+			return;
+		}
+		// Nothing will exit to restart a stream, so back off here the same way
+		printf("Failed to run status block \"%s\", retrying in %dms\n", block->command, state->restart_delay_ms);
+		wl_event_source_timer_update(state->interval_timer, state->restart_delay_ms);
+		state->restart_delay_ms = MIN(state->restart_delay_ms * 2, STATUS_STREAM_MAX_RESTART_MS);
+		return;
+	}
+	
+	state->read_length = 0;
+	state->read_source = wl_event_loop_add_fd(event_loop, state->fd, WL_EVENT_READABLE, 
+											  &handle_status_block_readable, (void*)(intptr_t)index);
+	if (block->timeout_seconds && !block->stream) {
+		wl_event_source_timer_update(state->timeout_timer, block->timeout_seconds * 1000);
+	}
+}
+
+// Also used to restart streaming blocks
+static int handle_status_block_interval(void *data) {
+	int index = (intptr_t)data;
+	status_run_block(index);
+	if (!STATUS_BLOCKS[index].stream) {
+		wl_event_source_timer_update(status_block_states[index].interval_timer, 
+									 STATUS_BLOCKS[index].interval_seconds * 1000);
+	}
+	return 0;
+}
+
+static int handle_status_block_timeout(void *data) {
+	int index = (intptr_t)data;
+	printf("Status block \"%s\" timed out\n", STATUS_BLOCKS[index].command);
+	status_finish_block(index);
+	return 0;
+}
+
+// The uevent a watch cares about, or NULL if every message on its fd counts
+static const char *status_watch_uevent_subsystem(Status_Watch_Function *watch) {
+	if (watch == status_watch_power_supply) return "SUBSYSTEM=power_supply";
+	if (watch == status_watch_backlight) return "SUBSYSTEM=backlight";
+	return NULL;
+}
+
+static int handle_status_block_watch(int fd, uint32_t mask, void *data) {
+	int index = (intptr_t)data;
+	const char *subsystem = status_watch_uevent_subsystem(STATUS_BLOCKS[index].watch);
+	bool changed = !subsystem;
+	char message[4096];
+	ssize_t length;
+	
+	// Only that something changed matters, the block reads the state itself.
+	// A uevent is "action@devpath\0KEY=value\0...", one per datagram.
+	while ((length = read(fd, message, sizeof(message) - 1)) > 0) {
+		if (changed) continue;
+		message[length] = 0;
+		for (char *field = message; field < message + length; field += strlen(field) + 1) {
+			if (!strcmp(field, subsystem)) {
+				changed = true;
+				break;
+			}
+		}
+	}
+	
+	if (changed) status_run_block(index);
+	return 0;
+}
+
+static int handle_status_refresh_signal(int signal_number, void *data) {
+	for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
+		if (STATUS_BLOCKS[i].signal && (SIGRTMIN + STATUS_BLOCKS[i].signal == signal_number)) {
+			status_run_block(i);
+		}
+	}
+	return 0;
 }
 
 #ifdef ENABLE_MPD_STATUS
-#include <mpd/connection.h>
-#include <mpd/client.h>
-#include <mpd/song.h>
+/* ================================================================================
+ * MPD
+ *
+ * One persistent connection that sits in MPD's idle command with its socket on
+ * the event loop. MPD answers the idle when the player or queue changes, and
+ * every status_mpd block gets refreshed then, so there is no polling.
+ *
+ * Nothing here blocks: the socket is connected without waiting, and commands
+ * and responses go through mpd_async, driven by the fd source.
+ * ================================================================================*/
+#include <mpd/async.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+#ifndef STATUS_MPD_SOCKET
+#define STATUS_MPD_SOCKET "/run/mpd/socket" // Used when MPD_HOST isn't set
+#endif
+
+#define STATUS_MPD_MIN_RECONNECT_MS 1000
+#define STATUS_MPD_MAX_RECONNECT_MS 60000
+
+static struct {
+	struct mpd_async *async;
+	struct wl_event_source *source;
+	struct wl_event_source *reconnect_timer;
+	int reconnect_delay_ms;
+	bool reported_error; // Only print the first failure until we connect again
+	bool greeted; // Got MPD's "OK MPD version" banner
+	bool idling; // Waiting on idle, otherwise on currentsong
+	int ignored_responses; // OKs that don't end a currentsong or idle, e.g. for password
+	char password[64];
+	char artist[STATUS_BLOCK_MAX], title[STATUS_BLOCK_MAX], file[STATUS_BLOCK_MAX];
+	char text[STATUS_BLOCK_MAX];
+} status_mpd_state;
+
 static int status_mpd(char *buffer, int max) {
-	int ret = 0;
-	struct mpd_connection *mpd;
-	mpd = mpd_connection_new(NULL, 0, 0);
+	return snprintf(buffer, max, "%s", status_mpd_state.text);
+}
+
+static void status_mpd_refresh_blocks() {
+	for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
+		if (STATUS_BLOCKS[i].function == status_mpd) status_run_block(i);
+	}
+}
+
+// Builds the text from the fields currentsong returned
+static void status_mpd_update_song() {
+	char *text = status_mpd_state.text;
+	const int max = sizeof(status_mpd_state.text);
 	
-	if (!mpd) return 0;
+	text[0] = 0;
+	if (status_mpd_state.artist[0] && status_mpd_state.title[0]) {
+		snprintf(text, max, "%s - %s", status_mpd_state.artist, status_mpd_state.title);
+	}
+	else if (status_mpd_state.file[0]) {
+		const char *title = strrchr(status_mpd_state.file, '/');
+		snprintf(text, max, "%s", title ? title + 1 : status_mpd_state.file);
+	}
 	
-	if (mpd_connection_get_error(mpd) != MPD_ERROR_SUCCESS) {
-		printf("Failed to connect to MPD: %s\n", mpd_connection_get_error_message(mpd));
-		mpd_connection_free(mpd);
-		return 0;
+	status_mpd_state.artist[0] = 0;
+	status_mpd_state.title[0] = 0;
+	status_mpd_state.file[0] = 0;
+	status_mpd_refresh_blocks();
+}
+
+static void status_mpd_disconnect() {
+	if (status_mpd_state.source) wl_event_source_remove(status_mpd_state.source);
+	if (status_mpd_state.async) mpd_async_free(status_mpd_state.async);
+	status_mpd_state.source = NULL;
+	status_mpd_state.async = NULL;
+	status_mpd_state.greeted = false;
+	status_mpd_state.idling = false;
+	status_mpd_state.ignored_responses = 0;
+	status_mpd_state.artist[0] = 0;
+	status_mpd_state.title[0] = 0;
+	status_mpd_state.file[0] = 0;
+	status_mpd_state.text[0] = 0;
+	status_mpd_refresh_blocks();
+	
+	wl_event_source_timer_update(status_mpd_state.reconnect_timer, status_mpd_state.reconnect_delay_ms);
+	status_mpd_state.reconnect_delay_ms = MIN(status_mpd_state.reconnect_delay_ms * 2, STATUS_MPD_MAX_RECONNECT_MS);
+}
+
+static void status_mpd_fail(const char *error) {
+	if (status_mpd_state.greeted) {
+		printf("Lost connection to MPD: %s\n", error);
+	}
+	else if (!status_mpd_state.reported_error) {
+		printf("Failed to connect to MPD: %s\n", error);
+		status_mpd_state.reported_error = true;
+	}
+	status_mpd_disconnect();
+}
+
+// Starts a non-blocking connect to where libmpdclient would look: MPD_HOST as a
+// socket path, an abstract socket (@name) or a host with MPD_PORT, optionally
+// prefixed with password@. Host names are still resolved synchronously, so
+// give MPD_HOST an address or a socket to avoid ever blocking on DNS.
+static int status_mpd_connect() {
+	char host[256];
+	const char *port = getenv("MPD_PORT");
+	const char *environment_host = getenv("MPD_HOST");
+	int fd = -1;
+	
+	snprintf(host, sizeof(host), "%s", environment_host ? environment_host : STATUS_MPD_SOCKET);
+	status_mpd_state.password[0] = 0;
+	char *at = strchr(host, '@');
+	if (at && at != host) {
+		*at = 0;
+		snprintf(status_mpd_state.password, sizeof(status_mpd_state.password), "%s", host);
+		memmove(host, at + 1, strlen(at + 1) + 1);
+	}
+	
+	if (host[0] == '/' || host[0] == '@') {
+		struct sockaddr_un address = {.sun_family = AF_UNIX};
+		snprintf(address.sun_path, sizeof(address.sun_path), "%s", host);
+		if (host[0] == '@') address.sun_path[0] = 0;
+		
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr*)&address, 
+							   offsetof(struct sockaddr_un, sun_path) + strlen(host)) && errno != EINPROGRESS) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
 	}
 	
-	struct mpd_song *song = mpd_run_current_song(mpd);
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV};
+	struct addrinfo *addresses;
+	if (getaddrinfo(host, port ? port : "6600", &hints, &addresses)) return -1;
+	
+	for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+		fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+		if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) && errno != EINPROGRESS) {
+			close(fd);
+			fd = -1;
+		}
+	}
 	
-	if (song) {
-		const char *artist = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
-		const char *title = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
+	freeaddrinfo(addresses);
+	return fd;
+}
+
+// Returns false if the connection should be dropped
+static bool status_mpd_handle_line(const char *line) {
+	struct mpd_async *async = status_mpd_state.async;
+	
+	if (!status_mpd_state.greeted) {
+		if (strncmp(line, "OK MPD ", 7)) return false;
+		status_mpd_state.greeted = true;
+		status_mpd_state.reported_error = false;
+		status_mpd_state.reconnect_delay_ms = STATUS_MPD_MIN_RECONNECT_MS;
 		
-		if (!artist || !title) {
-			const char *uri = mpd_song_get_uri(song);
-			title = strrchr(uri, '/');
-			if (title) title++;
-			else title = uri;
-			ret = snprintf(buffer, max, "%s", title);
+		if (status_mpd_state.password[0]) {
+			if (!mpd_async_send_command(async, "password", status_mpd_state.password, NULL)) return false;
+			status_mpd_state.ignored_responses++;
 		}
-		else {
-			ret = snprintf(buffer, max, "%s - %s", artist, title);
+		return mpd_async_send_command(async, "currentsong", NULL);
+	}
+	
+	if (!strncmp(line, "ACK ", 4)) {
+		printf("MPD error: %s\n", line);
+		return false;
+	}
+	
+	if (strcmp(line, "OK")) {
+		if (status_mpd_state.idling) return true;
+		
+		const struct { const char *name; char *value; } fields[] = {
+			{"Artist: ", status_mpd_state.artist},
+			{"Title: ", status_mpd_state.title},
+			{"file: ", status_mpd_state.file},
+		};
+		for (int i = 0; i < ARRAY_LENGTH(fields); ++i) {
+			size_t length = strlen(fields[i].name);
+			// Keep the first of repeated tags
+			if (!strncmp(line, fields[i].name, length) && !fields[i].value[0]) {
+				snprintf(fields[i].value, STATUS_BLOCK_MAX, "%s", &line[length]);
+			}
 		}
+		return true;
+	}
+	
+	if (status_mpd_state.ignored_responses) {
+		status_mpd_state.ignored_responses--;
+		return true;
+	}
+	
+	// Something changed, ask what's playing now
+	if (status_mpd_state.idling) {
+		status_mpd_state.idling = false;
+		return mpd_async_send_command(async, "currentsong", NULL);
 	}
 	
-	mpd_song_free(song);
-	mpd_connection_free(mpd);
-	return ret;
+	status_mpd_update_song();
+	status_mpd_state.idling = true;
+	return mpd_async_send_command(async, "idle", "player", "playlist", NULL);
+}
+
+static int handle_status_mpd_event(int fd, uint32_t mask, void *data) {
+	struct mpd_async *async = status_mpd_state.async;
+	enum mpd_async_event events = 0;
+	char *line;
+	
+	if (mask & WL_EVENT_READABLE) events |= MPD_ASYNC_EVENT_READ;
+	if (mask & WL_EVENT_WRITABLE) events |= MPD_ASYNC_EVENT_WRITE;
+	if (mask & WL_EVENT_HANGUP) events |= MPD_ASYNC_EVENT_HUP;
+	if (mask & WL_EVENT_ERROR) events |= MPD_ASYNC_EVENT_ERROR;
+	
+	if (!mpd_async_io(async, events)) {
+		status_mpd_fail(mpd_async_get_error_message(async));
+		return 0;
+	}
+	
+	while ((line = mpd_async_recv_line(async))) {
+		if (!status_mpd_handle_line(line)) {
+			status_mpd_fail(mpd_async_get_error(async) != MPD_ERROR_SUCCESS ? 
+							mpd_async_get_error_message(async) : "Unexpected response");
+			return 0;
+		}
+	}
+	
+	if (mpd_async_get_error(async) != MPD_ERROR_SUCCESS) {
+		status_mpd_fail(mpd_async_get_error_message(async));
+		return 0;
+	}
+	
+	// Only wait for writability while commands are queued
+	uint32_t wanted = WL_EVENT_READABLE;
+	if (mpd_async_events(async) & MPD_ASYNC_EVENT_WRITE) wanted |= WL_EVENT_WRITABLE;
+	wl_event_source_fd_update(status_mpd_state.source, wanted);
+	return 0;
 }
-#endif
 
+static int handle_status_mpd_reconnect(void *data) {
+	struct wl_event_loop *event_loop = wl_display_get_event_loop(server.display);
+	int fd = status_mpd_connect();
+	
+	if (fd < 0) {
+		status_mpd_fail(strerror(errno));
+		return 0;
+	}
+	
+	// Owns fd from here. The banner arrives once the connect completes, and a
+	// failed connect shows up as a hangup or error on the source.
+	status_mpd_state.async = mpd_async_new(fd);
+	if (!status_mpd_state.async) {
+		close(fd);
+		status_mpd_fail("Out of memory");
+		return 0;
+	}
+	status_mpd_state.source = wl_event_loop_add_fd(event_loop, fd, WL_EVENT_READABLE, &handle_status_mpd_event, NULL);
+	return 0;
+}
 
+static void setup_status_mpd() {
+	struct wl_event_loop *event_loop = wl_display_get_event_loop(server.display);
+	status_mpd_state.reconnect_delay_ms = STATUS_MPD_MIN_RECONNECT_MS;
+	status_mpd_state.reconnect_timer = wl_event_loop_add_timer(event_loop, &handle_status_mpd_reconnect, NULL);
+	handle_status_mpd_reconnect(NULL);
+}
+#endif
 
+static void setup_status_blocks() {
+	struct wl_event_loop *event_loop = wl_display_get_event_loop(server.display);
+#ifdef ENABLE_MPD_STATUS
+	bool use_mpd = false;
+#endif
+	
+	
+	for (int i = 0; i < NUM_STATUS_BLOCKS; ++i) {
+		Status_Block_State *state = &status_block_states[i];
+		const Status_Block *block = &STATUS_BLOCKS[i];
+		
+		state->interval_timer = wl_event_loop_add_timer(event_loop, &handle_status_block_interval, (void*)(intptr_t)i);
+		state->timeout_timer = wl_event_loop_add_timer(event_loop, &handle_status_block_timeout, (void*)(intptr_t)i);
+		state->restart_delay_ms = STATUS_STREAM_MIN_RESTART_MS;
+#ifdef ENABLE_MPD_STATUS
+		use_mpd |= block->function == status_mpd;
+#endif
+		if (block->function && block->stream) {
+			printf("Status block %d is native and can't stream\n", i);
+		}
+		
+		// Only one signal source per signal number, it refreshes every block using it
+		bool signal_registered = false;
+		for (int j = 0; j < i; ++j) signal_registered |= STATUS_BLOCKS[j].signal == block->signal;
+		if (block->signal && !signal_registered) {
+			wl_event_loop_add_signal(event_loop, SIGRTMIN + block->signal, &handle_status_refresh_signal, NULL);
+		}
+		
+		if (block->watch) {
+			int fd = block->function ? block->watch() : -1;
+			if (fd >= 0) {
+				wl_event_loop_add_fd(event_loop, fd, WL_EVENT_READABLE, &handle_status_block_watch, (void*)(intptr_t)i);
+			}
+			else {
+				printf("Failed to watch status block %d, falling back to its interval\n", i);
+			}
+		}
+		
+		status_run_block(i);
+		if (block->interval_seconds && !block->stream) {
+			wl_event_source_timer_update(state->interval_timer, block->interval_seconds * 1000);
+		}
+	}
+	
+#ifdef ENABLE_MPD_STATUS
+	if (use_mpd) setup_status_mpd();
+#endif
+}
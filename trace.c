@@ -0,0 +1,378 @@
+/*
+   Copyright 2023 Jamie Dennis
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/* ================================================================================
+ * Input traces
+ *
+ * `capra --record file` writes every seat input event to file as it reaches
+ * the input handlers. `capra --replay file` runs on the headless backend and
+ * feeds the trace back in at the recorded pace, emitting the same wlr_cursor
+ * and keyboard group signals a real device would, so the events go through
+ * the normal handlers. When the trace ends it prints frame and dispatch times
+ * and exits.
+ *
+ * `--cpu-load` starts a busy loop per CPU for as long as capra runs, to show
+ * how much the main loop gets held up when the machine is saturated.
+ *
+ * The file is a header followed by fixed-size records in host byte order, so
+ * it's only meant to be replayed on the machine type it was recorded on.
+ * ================================================================================*/
+#define INPUT_TRACE_MAGIC "CAPRAIT"
+#define INPUT_TRACE_VERSION 1
+// How long replay keeps going after the last event, so the frames it caused get counted
+#define INPUT_TRACE_TAIL_MS 1000
+#define INPUT_TRACE_OUTPUT_WIDTH 1920
+#define INPUT_TRACE_OUTPUT_HEIGHT 1080
+
+enum Input_Record_Type {
+	INPUT_RECORD_KEY,
+	INPUT_RECORD_BUTTON,
+	INPUT_RECORD_MOTION,
+	INPUT_RECORD_MOTION_ABSOLUTE,
+	INPUT_RECORD_AXIS,
+	INPUT_RECORD_FRAME,
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+} Input_Trace_Header;
+
+typedef struct {
+	uint32_t time_msec; // Since the first event in the trace
+	uint8_t type;
+	uint8_t state; // Key or button state, or axis orientation
+	uint8_t source; // Axis source
+	uint8_t padding;
+	int32_t code; // Keycode, button or discrete axis steps
+	float values[4]; // Motion: dx, dy, unaccelerated dx, dy. Absolute motion: x, y. Axis: delta
+} Input_Record;
+
+static struct {
+	FILE *file;
+	uint32_t first_time_msec;
+	uint32_t last_time_msec;
+	bool recording;
+	bool replaying;
+	bool replay_done; // All events sent, waiting out INPUT_TRACE_TAIL_MS
+	bool cpu_load;
+	pid_t *load_pids;
+	uint32_t load_count;
+
+	Input_Record *records;
+	uint32_t record_count; // Also counts timed events while recording
+	uint32_t next_record;
+	uint64_t start_us;
+	struct wl_event_source *timer;
+	struct wlr_pointer pointer; // Stands in for the recorded pointer, it isn't attached to the cursor
+
+	uint64_t frame_count;
+	Latency_Histogram dispatch; // Time spent in the handlers per event
+	Latency_Histogram frame; // Time spent in handle_output_frame
+	Latency_Histogram frame_interval;
+	uint64_t last_frame_us;
+} input_trace;
+
+static bool start_input_recording(const char *path) {
+	Input_Trace_Header header = {INPUT_TRACE_MAGIC, INPUT_TRACE_VERSION, sizeof(Input_Record)};
+
+	input_trace.file = fopen(path, "wb");
+	if (!input_trace.file || fwrite(&header, sizeof(header), 1, input_trace.file) != 1) {
+		fprintf(stderr, "Failed to open input trace %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	input_trace.recording = true;
+	printf("Recording input to %s\n", path);
+	return true;
+}
+
+// Called by the input handlers with the event's own time
+static void record_input(uint32_t time_msec, Input_Record record) {
+	if (!input_trace.recording) return;
+
+	// Frames have no time of their own, they go with the events they end
+	if (record.type == INPUT_RECORD_FRAME) {
+		record.time_msec = input_trace.last_time_msec;
+	}
+	else {
+		if (!input_trace.record_count++) input_trace.first_time_msec = time_msec;
+		record.time_msec = input_trace.last_time_msec = time_msec - input_trace.first_time_msec;
+	}
+	fwrite(&record, sizeof(record), 1, input_trace.file);
+}
+
+static bool load_input_trace(const char *path) {
+	Input_Trace_Header header;
+	FILE *file = fopen(path, "rb");
+	long size = 0;
+
+	if (file && !fseek(file, 0, SEEK_END)) size = ftell(file);
+	if (!file || size < (long)sizeof(header)) {
+		fprintf(stderr, "Failed to open input trace %s\n", path);
+		if (file) fclose(file);
+		return false;
+	}
+
+	rewind(file);
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, INPUT_TRACE_MAGIC, sizeof(header.magic)) ||
+		header.version != INPUT_TRACE_VERSION || header.record_size != sizeof(Input_Record)) {
+		fprintf(stderr, "%s is not a compatible input trace\n", path);
+		fclose(file);
+		return false;
+	}
+
+	input_trace.record_count = (size - sizeof(header)) / sizeof(Input_Record);
+	input_trace.records = malloc(MAX(input_trace.record_count, 1) * sizeof(Input_Record));
+	input_trace.record_count = fread(input_trace.records, sizeof(Input_Record), input_trace.record_count, file);
+	fclose(file);
+
+	input_trace.replaying = true;
+	printf("Replaying %u input events from %s\n", input_trace.record_count, path);
+	return true;
+}
+
+static void dispatch_input_record(const Input_Record *record) {
+	struct wlr_pointer *pointer = &input_trace.pointer;
+	// Use the current time, so input latency is measured the same as for live input
+	uint32_t time_msec = get_monotonic_us() / 1000;
+
+	switch (record->type) {
+		case INPUT_RECORD_KEY: {
+			struct wlr_keyboard_key_event event = {
+				.time_msec = time_msec, .keycode = record->code, .update_state = true, .state = record->state,
+			};
+			wlr_keyboard_notify_key(&server.keyboard_group->keyboard, &event);
+		} break;
+
+		case INPUT_RECORD_BUTTON: {
+			struct wlr_pointer_button_event event = {
+				.pointer = pointer, .time_msec = time_msec, .button = record->code, .state = record->state,
+			};
+			wl_signal_emit(&server.cursor->events.button, &event);
+		} break;
+
+		case INPUT_RECORD_MOTION: {
+			struct wlr_pointer_motion_event event = {
+				.pointer = pointer, .time_msec = time_msec,
+				.delta_x = record->values[0], .delta_y = record->values[1],
+				.unaccel_dx = record->values[2], .unaccel_dy = record->values[3],
+			};
+			wl_signal_emit(&server.cursor->events.motion, &event);
+		} break;
+
+		case INPUT_RECORD_MOTION_ABSOLUTE: {
+			struct wlr_pointer_motion_absolute_event event = {
+				.pointer = pointer, .time_msec = time_msec, .x = record->values[0], .y = record->values[1],
+			};
+			wl_signal_emit(&server.cursor->events.motion_absolute, &event);
+		} break;
+
+		case INPUT_RECORD_AXIS: {
+			struct wlr_pointer_axis_event event = {
+				.pointer = pointer, .time_msec = time_msec, .source = record->source,
+				.orientation = record->state, .delta = record->values[0], .delta_discrete = record->code,
+			};
+			wl_signal_emit(&server.cursor->events.axis, &event);
+		} break;
+
+		case INPUT_RECORD_FRAME:
+			wl_signal_emit(&server.cursor->events.frame, pointer);
+			break;
+	}
+}
+
+static void print_replay_report() {
+	double seconds = (get_monotonic_us() - input_trace.start_us) / 1000000.0;
+
+	printf("Replayed %u input events in %.2fs, %lu frames (%.1f fps)\n", input_trace.record_count, seconds,
+		   (unsigned long)input_trace.frame_count, input_trace.frame_count / seconds);
+	if (input_trace.dispatch.count) print_latency_histogram("dispatch", &input_trace.dispatch);
+	if (input_trace.frame.count) print_latency_histogram("frame", &input_trace.frame);
+	if (input_trace.frame_interval.count) print_latency_histogram("frame interval", &input_trace.frame_interval);
+	handle_latency_dump_signal(SIGUSR1, NULL);
+}
+
+static int handle_replay_timer(void *data) {
+	if (input_trace.replay_done) {
+		print_replay_report();
+		wl_display_terminate(server.display);
+		return 0;
+	}
+
+	uint32_t elapsed_ms = (get_monotonic_us() - input_trace.start_us) / 1000;
+
+	while (input_trace.next_record < input_trace.record_count &&
+		   input_trace.records[input_trace.next_record].time_msec <= elapsed_ms) {
+		uint64_t start = get_monotonic_us();
+		dispatch_input_record(&input_trace.records[input_trace.next_record++]);
+		add_latency_sample(&input_trace.dispatch, get_monotonic_us() - start);
+	}
+
+	if (input_trace.next_record < input_trace.record_count) {
+		uint32_t next_ms = input_trace.records[input_trace.next_record].time_msec;
+		wl_event_source_timer_update(input_trace.timer, MAX(next_ms - elapsed_ms, 1));
+	}
+	else {
+		input_trace.replay_done = true;
+		wl_event_source_timer_update(input_trace.timer, INPUT_TRACE_TAIL_MS);
+	}
+	return 0;
+}
+
+// Call once the backend has started
+static void start_input_replay() {
+	if (!input_trace.replaying) return;
+
+	input_trace.start_us = get_monotonic_us();
+	input_trace.timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.display), &handle_replay_timer, NULL);
+	wl_event_source_timer_update(input_trace.timer, 1);
+}
+
+// Called at the end of handle_output_frame with the time the frame started
+static void record_replay_frame(const struct timespec *start) {
+	if (!input_trace.replaying) return;
+
+	uint64_t start_us = start->tv_sec * 1000000ull + start->tv_nsec / 1000;
+	input_trace.frame_count++;
+	add_latency_sample(&input_trace.frame, get_monotonic_us() - start_us);
+	if (input_trace.last_frame_us) add_latency_sample(&input_trace.frame_interval, start_us - input_trace.last_frame_us);
+	input_trace.last_frame_us = start_us;
+}
+
+static void start_cpu_load() {
+	char *argv[] = {"/bin/sh", "-c", "while :; do :; done", NULL};
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!input_trace.cpu_load) return;
+	
+	// Launched programs run SCHED_OTHER at nice 0, whatever the main loop runs at
+	input_trace.load_pids = calloc(MAX(cpu_count, 1), sizeof(pid_t));
+	for (long i = 0; i < MAX(cpu_count, 1); ++i) {
+		pid_t pid = launch_program(argv);
+		if (pid > 0) input_trace.load_pids[input_trace.load_count++] = pid;
+	}
+}
+
+static void finish_input_trace() {
+	if (input_trace.file) fclose(input_trace.file);
+	free(input_trace.records);
+	for (uint32_t i = 0; i < input_trace.load_count; ++i) kill(input_trace.load_pids[i], SIGKILL);
+	free(input_trace.load_pids);
+}
+
+/* ================================================================================
+ * Client table benchmark
+ *
+ * `capra --benchmark-tables` times hit testing and culling over a Client_Table
+ * against walking the layer list the way it was done before the tables,
+ * following each client to its wlr_surface, then exits. Clients are fake layer
+ * surfaces scattered over a 4K area so that some are off a 1080p output.
+ * ================================================================================*/
+#define TABLE_BENCHMARK_QUERIES 100000
+
+static Client *list_hit_test(struct wl_list *list, int32_t x, int32_t y) {
+	Client *client;
+	wl_list_for_each(client, list, link) {
+		struct wlr_surface *surface = get_client_wlr_surface(client);
+		if (x >= client->config.x && y >= client->config.y &&
+			x < client->config.x + surface->current.width && y < client->config.y + surface->current.height) {
+			return client;
+		}
+	}
+	return NULL;
+}
+
+static uint32_t list_cull(struct wl_list *list, const struct wlr_box *box) {
+	uint32_t count = 0;
+	Client *client;
+	wl_list_for_each_reverse(client, list, link) {
+		struct wlr_surface *surface = get_client_wlr_surface(client);
+		count += client->config.x < box->x + box->width && client->config.x + surface->current.width > box->x &&
+			client->config.y < box->y + box->height && client->config.y + surface->current.height > box->y;
+	}
+	return count;
+}
+
+static void run_table_benchmark() {
+	static const uint32_t client_counts[] = {10, 100, 1000};
+	
+	for (uint32_t c = 0; c < ARRAY_LENGTH(client_counts); ++c) {
+		uint32_t count = client_counts[c];
+		Client_Table table = {0};
+		struct wl_list list;
+		Client **clients = calloc(count, sizeof(*clients));
+		uint8_t *visible;
+		uintptr_t sink = 0;
+		uint64_t start, times[4];
+		
+		wl_list_init(&list);
+		srand(count);
+		for (uint32_t i = 0; i < count; ++i) {
+			Client *client = clients[i] = pool_alloc(&pools.clients);
+			client->type = CLIENT_TYPE_LAYER;
+			client->layer_surface = calloc(1, sizeof(*client->layer_surface));
+			client->layer_surface->surface = calloc(1, sizeof(*client->layer_surface->surface));
+			client->layer_surface->surface->current.width = 100 + rand() % 900;
+			client->layer_surface->surface->current.height = 100 + rand() % 600;
+			client->config.x = rand() % 3840 - 960;
+			client->config.y = rand() % 2160 - 540;
+			wl_list_insert(&list, &client->link);
+			client_table_insert(&table, client);
+		}
+		visible = malloc(table.capacity); // Culling writes whole blocks
+		
+		start = get_monotonic_us();
+		for (uint32_t i = 0; i < TABLE_BENCHMARK_QUERIES; ++i) {
+			sink += (uintptr_t)client_table_hit_test(&table, i * 7919 % 1920, i * 104729 % 1080);
+		}
+		times[0] = get_monotonic_us() - start;
+		
+		start = get_monotonic_us();
+		for (uint32_t i = 0; i < TABLE_BENCHMARK_QUERIES; ++i) {
+			sink -= (uintptr_t)list_hit_test(&list, i * 7919 % 1920, i * 104729 % 1080);
+		}
+		times[1] = get_monotonic_us() - start;
+		
+		start = get_monotonic_us();
+		for (uint32_t i = 0; i < TABLE_BENCHMARK_QUERIES; ++i) {
+			struct wlr_box box = {(int32_t)(i % 64) - 32, 0, 1920, 1080};
+			sink += client_table_cull(&table, &box, visible);
+		}
+		times[2] = get_monotonic_us() - start;
+		
+		start = get_monotonic_us();
+		for (uint32_t i = 0; i < TABLE_BENCHMARK_QUERIES; ++i) {
+			struct wlr_box box = {(int32_t)(i % 64) - 32, 0, 1920, 1080};
+			sink -= list_cull(&list, &box);
+		}
+		times[3] = get_monotonic_us() - start;
+		
+		// Both sides find the same thing, so sink ends up 0 unless they disagree
+		printf("%4u clients: hit test %8.1fns table %8.1fns list, cull %8.1fns table %8.1fns list%s\n", count,
+			   times[0] * 1000.0 / TABLE_BENCHMARK_QUERIES, times[1] * 1000.0 / TABLE_BENCHMARK_QUERIES,
+			   times[2] * 1000.0 / TABLE_BENCHMARK_QUERIES, times[3] * 1000.0 / TABLE_BENCHMARK_QUERIES,
+			   sink ? " (results differ!)" : "");
+		
+		for (uint32_t i = 0; i < count; ++i) {
+			free(clients[i]->layer_surface->surface);
+			free(clients[i]->layer_surface);
+			pool_free(&pools.clients, clients[i]);
+		}
+		client_table_finish(&table);
+		free(clients);
+		free(visible);
+	}
+}